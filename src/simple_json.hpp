@@ -1,16 +1,21 @@
 #ifndef JSONPARSER_HPP
 #define JSONPARSER_HPP
-#endif
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <regex>
 #include <stack>
 #include <string>
 #include <string_view>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -24,8 +29,26 @@ using std::string;
 using std::string_view;
 
 struct JsonNode;
+class ElementIterator;
 class Json;
 
+// Iterator pair returned by the iteration views of JsonNode. A default
+// constructed range is empty.
+template <typename Iter>
+class NodeRange {
+ public:
+  NodeRange() = default;
+  NodeRange(Iter begin, Iter end) : begin_(begin), end_(end) {}
+
+  Iter begin() const { return begin_; }
+  Iter end() const { return end_; }
+  bool empty() const { return begin_ == end_; }
+
+ private:
+  Iter begin_{};
+  Iter end_{};
+};
+
 template <
     typename T,
     typename Checker = typename std::enable_if<
@@ -61,37 +84,205 @@ struct JsonNodeRef {
     }
   }
 
+  auto items() {
+    return has_value() ? node_->items() : decltype(node_->items())();
+  }
+  auto items() const {
+    return has_value() ? cnode()->items() : decltype(cnode()->items())();
+  }
+  // Reads packed lists in place; elements are edited through operator->.
+  auto elements() const {
+    return has_value() ? cnode()->elements()
+                       : decltype(cnode()->elements())();
+  }
+  auto keys() const {
+    return has_value() ? cnode()->keys() : decltype(cnode()->keys())();
+  }
+
  private:
+  const T* cnode() const { return node_; }
+
   T* node_ = nullptr;
 };
 
+// Read-only view over the contiguous storage of a packed list.
+template <typename T>
+class ArraySpan {
+ public:
+  ArraySpan(const T* data = nullptr, size_t size = 0)
+      : data_(data), size_(size) {}
+
+  const T* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+  const T& operator[](size_t index) const { return data_[index]; }
+
+ private:
+  const T* data_;
+  size_t size_;
+};
+
+// Hash index from the value at a dotted member path ("id", "user.id") to
+// the first element of a list of objects holding that value, as built by
+// JsonNode::indexBy. Values match by operator==, so 1 and 1.0 are different
+// keys. Elements that are not objects or lack the path are left out. An
+// edit anywhere in the list, through whichever reference, makes the index
+// rebuild on its next lookup. Lookups take a lock, so they may run
+// concurrently with other const access, though not with edits.
+class ListIndex {
+ public:
+  static constexpr size_t npos = size_t(-1);
+
+  // Position of the first element whose value at the path equals `key`.
+  size_t position(const JsonNode& key) const;
+
+  JsonNodeRef<const JsonNode> find(const JsonNode& key) const;
+
+  // Number of distinct values.
+  size_t size() const;
+
+ private:
+  friend struct JsonNode;
+
+  ListIndex(const JsonNode* list, string_view path, std::mutex* mutex);
+
+  void build() const;
+  void add(size_t position) const;
+  const JsonNode* keyOf(size_t position) const;
+
+  const JsonNode* list_;
+  std::vector<string> path_;
+  // Shared by the indexes of the list.
+  std::mutex* mutex_;
+  // Hash of the value to element position, one entry per distinct value.
+  mutable std::unordered_multimap<size_t, size_t> positions_;
+  mutable bool stale_ = true;
+};
+
 struct JsonNode {
   using ObjType = std::map<string, JsonNode>;
   using ListType = std::vector<JsonNode>;
   using StringType = string;
-  enum Type { Obj, List, /* String, */ OwnedString, Int, Float, Bool, Error };
+  using IntListType = std::vector<int64_t>;
+  using FloatListType = std::vector<double>;
+  using BoolListType = std::vector<bool>;
+  // IntList, FloatList and BoolList are packed lists: homogeneous lists of
+  // int64_t, double and bool kept in contiguous storage instead of one node
+  // per element. They report isList(). The spans, the const elements() and
+  // str() read them in place. The const at() and toList() hand out nodes,
+  // so their first call builds a mirror of one node per element, which
+  // costs as much memory as the unpacked list and stays until the list
+  // changes. Mutable element access (operator[], push of a mismatched
+  // value) converts them into a regular List once.
+  enum Type {
+    Obj,
+    List,
+    /* String, */ OwnedString,
+    Int,
+    Float,
+    Bool,
+    Null,
+    IntList,
+    FloatList,
+    BoolList,
+    Error
+  };
+
+ protected:
+  using IndexMap = std::map<string, ListIndex, std::less<>>;
+  // What objects and lists cache about themselves, kept off the node since
+  // scalars, most of a tree, never need it.
+  struct Cache {
+    // Current while the node is clean; see touch().
+    std::atomic<size_t> hash{0};
+    // Owned; see packedNodes().
+    std::atomic<ListType*> packed_nodes{nullptr};
+    // Guards indexes, which const lookups build.
+    std::mutex index_mutex;
+    IndexMap indexes;
+    ~Cache() { delete packed_nodes.load(std::memory_order_relaxed); }
+  };
 
+ public:
+
+  // Replaces the node in place; it keeps its place in the tree.
   template <typename T>
   static void Reconstruct(JsonNode* node, T&& value) {
+    node->touch();
+    JsonNode* parent = node->parent_;
     node->~JsonNode();
     new (node) JsonNode(move(value));
+    node->parent_ = parent;
   }
 
   void insert(string key, JsonNode&& value_node) {
-    asObj().insert({move(key), move(value_node)});
+    auto inserted = asObj().insert({move(key), move(value_node)});
+    inserted.first->second.parent_ = this;
+  }
+
+  // Built indexes are extended with the new element rather than rebuilt.
+  void push(JsonNode&& value_node) {
+    dropPackedNodes();
+    // Packed lists hold no objects, so their indexes stay empty.
+    if (type_ == IntList && value_node.isInt()) {
+      invalidateHashes();
+      std::get<IntList>(data_).push_back(value_node.toInt());
+    } else if (type_ == FloatList && value_node.isFloat()) {
+      invalidateHashes();
+      std::get<FloatList>(data_).push_back(value_node.toFloat());
+    } else if (type_ == BoolList && value_node.isBool()) {
+      invalidateHashes();
+      std::get<BoolList>(data_).push_back(value_node.toBool());
+    } else {
+      unpack();
+      if (type_ != List) asList();
+      // Indexes stay live only on a clean list (see ListIndex::build()), so
+      // a clean list stays clean: the hash of the new element is folded into
+      // its own, the way computeHash() does.
+      const bool clean = hasHash();
+      const size_t hash = clean ? HashCombine(this->hash(), value_node.hash())
+                                : 0;
+      invalidateHashes();
+      append(move(value_node));
+      if (!clean) {
+        staleIndexes();
+        return;
+      }
+      cache_.load(std::memory_order_relaxed)->hash = hash;
+      clean_.store(true, std::memory_order_release);
+      const size_t position = std::get<List>(data_).size() - 1;
+      for (auto& [path, index] : cache_.load()->indexes) {
+        if (!index.stale_) index.add(position);
+      }
+    }
   }
 
-  void push(JsonNode&& value_node) { asList().push_back(move(value_node)); }
   JsonNode() { type_ = Error; }
 
-  JsonNode(JsonNode&& rhs) : type_(rhs.type_), data_(move(rhs.data_)) {
+  // The node takes over the caches of `rhs`, indexes included, but not its
+  // place in a tree.
+  JsonNode(JsonNode&& rhs) noexcept
+      : type_(rhs.type_),
+        clean_(rhs.clean_.load(std::memory_order_relaxed)),
+        data_(move(rhs.data_)),
+        cache_(rhs.cache_.exchange(nullptr)) {
+    rhs.touch();
     rhs.type_ = Error;
+    adoptChildren();
+    if (Cache* cache = cache_.load(std::memory_order_relaxed)) {
+      for (auto& [path, index] : cache->indexes) index.list_ = this;
+    }
   }
 
   JsonNode& operator=(JsonNode&& rhs) {
+    touch();
+    rhs.touch();
     type_ = rhs.type_;
     data_ = move(rhs.data_);
     rhs.type_ = Error;
+    adoptChildren();
     return *this;
   }
 
@@ -99,31 +290,139 @@ struct JsonNode {
 
   JsonNode(string str) : type_(OwnedString), data_(move(str)) {}
 
-  JsonNode(ObjType&& objs) : type_(Obj), data_(move(objs)) {}
+  JsonNode(ObjType&& objs) : type_(Obj), data_(move(objs)) {
+    adoptChildren();
+  }
+
+  JsonNode(int value) : type_(Int), data_(int64_t(value)) {}
 
-  JsonNode(int value) : type_(Int), data_(value) {}
+  JsonNode(int64_t value) : type_(Int), data_(value) {}
 
   JsonNode(double value) : type_(Float), data_(value) {}
 
   JsonNode(bool value) : type_(Bool), data_(value) {}
 
-  JsonNode(ListType&& list) : type_(List), data_(move(list)) {}
+  JsonNode(ListType&& list) : type_(List), data_(move(list)) {
+    adoptChildren();
+  }
+
+  JsonNode(std::nullptr_t) : type_(Null), data_(nullptr) {}
+
+  JsonNode(IntListType&& list) : type_(IntList), data_(move(list)) {}
+
+  JsonNode(FloatListType&& list) : type_(FloatList), data_(move(list)) {}
 
-  JsonNode(const JsonNode& rhs) : type_(rhs.type_), data_(rhs.data_) {}
+  JsonNode(BoolListType&& list) : type_(BoolList), data_(move(list)) {}
 
+  // Copies start without caches and outside any tree.
+  JsonNode(const JsonNode& rhs) : type_(Error) { copyFrom(rhs); }
+
+  // Copies first, so `rhs` may be a child of this node.
   JsonNode& operator=(const JsonNode& rhs) {
-    type_ = rhs.type_;
-    data_ = rhs.data_;
+    if (this != &rhs) {
+      *this = JsonNode(rhs);
+    }
     return *this;
   }
 
-  ~JsonNode() { type_ = Error; }
+  ~JsonNode() {
+    releaseChildren();
+    delete cache_.load(std::memory_order_relaxed);
+    type_ = Error;
+  }
+
+  // Cheap inequality when both sides already have an up to date hash.
+  // Nested containers are compared with an explicit stack, so deep trees
+  // cannot overflow the call stack.
+  bool operator==(const JsonNode& rhs) const {
+    if (!IsNestedContainer(*this) || !IsNestedContainer(rhs)) {
+      return shallowEquals(rhs, nullptr);
+    }
+    std::vector<std::pair<const JsonNode*, const JsonNode*>> pending{
+        {this, &rhs}};
+    while (!pending.empty()) {
+      auto [left, right] = pending.back();
+      pending.pop_back();
+      if (!left->shallowEquals(*right, &pending)) return false;
+    }
+    return true;
+  }
+
+  bool operator!=(const JsonNode& rhs) const { return !(*this == rhs); }
 
   JsonNode clone() { return *this; }
 
+  // Iterates the members of an object in key order.
+  class KeyIterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = string;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const string*;
+    using reference = const string&;
+
+    KeyIterator() = default;
+    explicit KeyIterator(ObjType::const_iterator iter) : iter_(iter) {}
+
+    reference operator*() const { return iter_->first; }
+    pointer operator->() const { return &iter_->first; }
+    KeyIterator& operator++() {
+      ++iter_;
+      return *this;
+    }
+    KeyIterator operator++(int) { return KeyIterator(iter_++); }
+    bool operator==(const KeyIterator& rhs) const { return iter_ == rhs.iter_; }
+    bool operator!=(const KeyIterator& rhs) const { return iter_ != rhs.iter_; }
+
+   private:
+    ObjType::const_iterator iter_{};
+  };
+
+  // Views for range-for loops and standard algorithms; they never allocate
+  // and are empty when the node is not of the matching kind. The mutable
+  // elements() unpacks packed lists to hand out their nodes, the const one
+  // reads them in place (see ElementIterator). Iterating is not an edit;
+  // edits made through the views reach the caches like any other.
+  NodeRange<ObjType::iterator> items() {
+    if (type_ == Obj) {
+      auto& obj = std::get<Obj>(data_);
+      return {obj.begin(), obj.end()};
+    }
+    return {};
+  }
+
+  NodeRange<ObjType::const_iterator> items() const {
+    if (type_ == Obj) {
+      const auto& obj = std::get<Obj>(data_);
+      return {obj.begin(), obj.end()};
+    }
+    return {};
+  }
+
+  NodeRange<KeyIterator> keys() const {
+    if (type_ == Obj) {
+      const auto& obj = std::get<Obj>(data_);
+      return {KeyIterator(obj.begin()), KeyIterator(obj.end())};
+    }
+    return {};
+  }
+
+  NodeRange<ListType::iterator> elements() {
+    unpack();
+    if (type_ == List) {
+      auto& list = std::get<List>(data_);
+      return {list.begin(), list.end()};
+    }
+    return {};
+  }
+
+  NodeRange<ElementIterator> elements() const;
+
   JsonNodeRef<const JsonNode> at(size_t index) const {
     if (type_ == List) {
       return {&std::get<List>(data_).at(index)};
+    } else if (isPacked()) {
+      return {&packedNodes().at(index)};
     } else {
       return {};
     }
@@ -138,6 +437,7 @@ struct JsonNode {
   }
 
   JsonNodeRef<JsonNode> operator[](size_t index) {
+    unpack();
     if (type_ == List) {
       return {&std::get<List>(data_)[index]};
     } else {
@@ -161,7 +461,7 @@ struct JsonNode {
     }
   }
 
-  int toInt() const {
+  int64_t toInt() const {
     if (type_ == Int) {
       return std::get<Int>(data_);
     } else {
@@ -178,8 +478,9 @@ struct JsonNode {
   }
 
   std::vector<const JsonNode*> toList() const {
-    if (type_ == List) {
-      const auto& list_ref = std::get<ListType>(data_);
+    if (isList()) {
+      const auto& list_ref =
+          type_ == List ? std::get<ListType>(data_) : packedNodes();
       std::vector<const JsonNode*> node_lists;
       node_lists.reserve(list_ref.size());
       for (const auto& node : list_ref) {
@@ -191,6 +492,31 @@ struct JsonNode {
     }
   }
 
+  ArraySpan<int64_t> asIntSpan() const {
+    if (type_ == IntList) {
+      const auto& list = std::get<IntList>(data_);
+      return {list.data(), list.size()};
+    }
+    return {};
+  }
+
+  ArraySpan<double> asDoubleSpan() const {
+    if (type_ == FloatList) {
+      const auto& list = std::get<FloatList>(data_);
+      return {list.data(), list.size()};
+    }
+    return {};
+  }
+
+  // std::vector<bool> is a bit vector and cannot be viewed as a span.
+  const BoolListType& asBoolBits() const {
+    static const BoolListType empty;
+    if (type_ == BoolList) {
+      return std::get<BoolList>(data_);
+    }
+    return empty;
+  }
+
   string toString() const {
     if (type_ == OwnedString) {
       return std::get<OwnedString>(data_);
@@ -199,71 +525,558 @@ struct JsonNode {
     }
   }
 
+  // Structural hash of the subtree, consistent with operator== (a packed
+  // list hashes like the same list of nodes). Objects and lists cache it on
+  // first use; other nodes are cheap to hash again. An edit drops the
+  // caches of the edited node and of its ancestors only, whichever
+  // reference it went through, so other trees and other branches keep
+  // theirs. Concurrent const callers may compute the same hash twice but
+  // never see a torn one.
+  size_t hash() const {
+    if (hasHash()) {
+      return cache_.load(std::memory_order_relaxed)->hash;
+    }
+    if (!IsNestedContainer(*this)) {
+      return computeHash();
+    }
+    // Nested containers are hashed before their parents, with an explicit
+    // stack so that deep trees cannot overflow the call stack; computeHash()
+    // then finds their hashes cached.
+    std::vector<std::pair<const JsonNode*, bool>> stack{{this, false}};
+    while (!stack.empty()) {
+      auto [node, expanded] = stack.back();
+      if (expanded) {
+        stack.pop_back();
+        node->cache().hash.store(node->computeHash(),
+                                 std::memory_order_relaxed);
+        node->clean_.store(true, std::memory_order_release);
+        continue;
+      }
+      stack.back().second = true;
+      auto visit = [&](const JsonNode& child) {
+        if (IsNestedContainer(child) && !child.hasHash()) {
+          stack.emplace_back(&child, false);
+        }
+      };
+      if (node->type_ == Obj) {
+        for (const auto& member : std::get<Obj>(node->data_)) {
+          visit(member.second);
+        }
+      } else if (node->type_ == List) {
+        for (const auto& child : std::get<List>(node->data_)) visit(child);
+      }
+    }
+    return cache_.load(std::memory_order_relaxed)->hash;
+  }
+
+  // Hash index of the elements of this list by the value at the dotted
+  // member `path`, built on first use and kept per path; it is empty when
+  // the node is not a list. push() adds to the indexes, while other edits
+  // of the list or below it make them rebuild on their next lookup; reads
+  // leave them alone. Copies of the node start without indexes, moves take
+  // them along.
+  const ListIndex& indexBy(string_view path) const {
+    Cache& cache = this->cache();
+    std::lock_guard<std::mutex> lock(cache.index_mutex);
+    auto iter = cache.indexes.find(path);
+    if (iter == cache.indexes.end()) {
+      iter = cache.indexes
+                 .emplace(string(path),
+                          ListIndex(this, path, &cache.index_mutex))
+                 .first;
+    }
+    return iter->second;
+  }
+
   Type type() const { return type_; }
 
   bool isType(Type type) const { return type_ == type; }
   bool isString() const { return type_ == OwnedString; }
   bool isNumber() const { return type_ == Int || type_ == Float; }
   bool isObj() const { return type_ == Obj; }
-  bool isList() const { return type_ == List; }
+  bool isList() const { return type_ == List || isPacked(); }
+  bool isPacked() const {
+    return type_ == IntList || type_ == FloatList || type_ == BoolList;
+  }
   bool isInt() const { return type_ == Int; }
   bool isFloat() const { return type_ == Float; }
   bool isBool() const { return type_ == Bool; }
+  bool isNull() const { return type_ == Null; }
 
   string str() const {
-    if (type_ == Error) return "";
     string builder;
-    bool first = true;
-    switch (type_) {
-      case Obj:
-        builder.push_back('{');
-        for (auto& [key, value] : std::get<Obj>(data_)) {
-          if (first) {
-            first = false;
-          } else {
-            builder.append(", ");
+    str(&builder);
+    return builder;
+  }
+
+  // Appends the serialized node to `builder`. Nesting is walked with an
+  // explicit stack, so deep trees cannot overflow the call stack.
+  void str(string* builder) const {
+    struct Frame {
+      const JsonNode* node;
+      size_t index;
+      ObjType::const_iterator member;
+    };
+    std::vector<Frame> stack;
+    const JsonNode* node = this;
+    while (node != nullptr) {
+      if (node->type_ == Obj) {
+        builder->push_back('{');
+        stack.push_back({node, 0, std::get<Obj>(node->data_).begin()});
+      } else if (node->type_ == List) {
+        builder->push_back('[');
+        stack.push_back({node, 0, {}});
+      } else {
+        node->scalarStr(builder);
+      }
+
+      // Move on to the next child of the innermost open container.
+      node = nullptr;
+      while (node == nullptr && !stack.empty()) {
+        Frame& frame = stack.back();
+        if (frame.node->type_ == Obj) {
+          const auto& obj = std::get<Obj>(frame.node->data_);
+          if (frame.member == obj.end()) {
+            builder->push_back('}');
+            stack.pop_back();
+            continue;
           }
-          builder.push_back('"');
-          builder.append(EscapeJson(key));
-          builder.append("\": ");
-          builder.append(value.str());
-        }
-        builder.push_back('}');
-        break;
-      case List:
-        builder.push_back('[');
-        for (auto& node : std::get<List>(data_)) {
-          if (first) {
-            first = false;
-          } else {
-            builder.append(", ");
+          if (frame.index++ > 0) builder->append(", ");
+          builder->push_back('"');
+          AppendEscapedJson(frame.member->first, builder);
+          builder->append("\": ");
+          node = &(frame.member++)->second;
+        } else {
+          const auto& list = std::get<List>(frame.node->data_);
+          if (frame.index == list.size()) {
+            builder->push_back(']');
+            stack.pop_back();
+            continue;
           }
-          builder.append(node.str());
+          if (frame.index > 0) builder->append(", ");
+          node = &list[frame.index++];
         }
-        builder.push_back(']');
-        break;
+      }
+    }
+  }
+
+ protected:
+  // Objects and lists that hold their hash are clean, and so is every
+  // object and list below them, since computing a hash caches the hashes of
+  // the subtree. An edit therefore only has to dirty the ancestors of the
+  // edited node up to the first one that is already dirty, which is
+  // immediate when edits follow each other under the same node.
+  void touch() {
+    dropPackedNodes();
+    staleIndexes();
+    invalidateHashes();
+  }
+
+  void invalidateHashes() {
+    clean_.store(false, std::memory_order_relaxed);
+    for (JsonNode* node = parent_;
+         node != nullptr && node->clean_.load(std::memory_order_relaxed);
+         node = node->parent_) {
+      node->clean_.store(false, std::memory_order_relaxed);
+      node->staleIndexes();
+    }
+  }
+
+  bool hasHash() const { return clean_.load(std::memory_order_acquire); }
+
+  // Caches of objects and lists, allocated on first use.
+  Cache& cache() const {
+    Cache* cache = cache_.load(std::memory_order_acquire);
+    if (cache == nullptr) {
+      auto built = std::make_unique<Cache>();
+      if (cache_.compare_exchange_strong(cache, built.get(),
+                                         std::memory_order_acq_rel)) {
+        cache = built.release();
+      }
+    }
+    return *cache;
+  }
+
+  void staleIndexes() const {
+    if (Cache* cache = cache_.load(std::memory_order_relaxed)) {
+      for (auto& [path, index] : cache->indexes) index.stale_ = true;
+    }
+  }
+
+  // Points the parent links of the children at this node, after it took
+  // them over or its list of nodes moved them.
+  void adoptChildren() {
+    if (type_ == Obj) {
+      for (auto& member : std::get<Obj>(data_)) member.second.parent_ = this;
+    } else if (type_ == List) {
+      for (auto& child : std::get<List>(data_)) child.parent_ = this;
+    }
+  }
+
+  // Appends to this list of nodes.
+  JsonNode& append(JsonNode&& value) {
+    auto& list = std::get<List>(data_);
+    const bool grows = list.size() == list.capacity();
+    list.push_back(move(value));
+    if (grows) {
+      adoptChildren();
+    } else {
+      list.back().parent_ = this;
+    }
+    return list.back();
+  }
+
+  // Serializes everything but objects and lists of nodes.
+  void scalarStr(string* builder) const {
+    switch (type_) {
       case OwnedString:
-        builder.push_back('"');
-        builder.append(EscapeJson(std::get<OwnedString>(data_)));
-        builder.push_back('"');
+        builder->push_back('"');
+        AppendEscapedJson(std::get<OwnedString>(data_), builder);
+        builder->push_back('"');
         break;
       case Int:
-        builder.append(std::to_string(std::get<Int>(data_)));
+        builder->append(std::to_string(std::get<Int>(data_)));
         break;
       case Float:
-        builder.append(std::to_string(std::get<Float>(data_)));
+        builder->append(std::to_string(std::get<Float>(data_)));
         break;
       case Bool:
-        builder.append(std::get<Bool>(data_) ? "true" : "false");
+        builder->append(std::get<Bool>(data_) ? "true" : "false");
+        break;
+      case Null:
+        builder->append("null");
+        break;
+      case IntList:
+      case FloatList:
+      case BoolList:
+        builder->push_back('[');
+        packedStr(0, packedSize(), builder);
+        builder->push_back(']');
         break;
       default:
         break;
     }
-    return builder;
   }
 
- protected:
+  size_t packedSize() const {
+    switch (type_) {
+      case IntList:
+        return std::get<IntList>(data_).size();
+      case FloatList:
+        return std::get<FloatList>(data_).size();
+      case BoolList:
+        return std::get<BoolList>(data_).size();
+      default:
+        return 0;
+    }
+  }
+
+  // Appends the elements [begin, end) of a packed list, each one after the
+  // first of the list preceded by a separator.
+  void packedStr(size_t begin, size_t end, string* builder) const {
+    for (size_t i = begin; i < end; ++i) {
+      if (i > 0) builder->append(", ");
+      switch (type_) {
+        case IntList:
+          builder->append(std::to_string(std::get<IntList>(data_)[i]));
+          break;
+        case FloatList:
+          builder->append(std::to_string(std::get<FloatList>(data_)[i]));
+          break;
+        case BoolList:
+          builder->append(std::get<BoolList>(data_)[i] ? "true" : "false");
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+  // Compares everything but the children of objects and lists of nodes,
+  // which are added to `pending` in pairs; without `pending` they are
+  // compared in place.
+  bool shallowEquals(
+      const JsonNode& rhs,
+      std::vector<std::pair<const JsonNode*, const JsonNode*>>* pending) const {
+    if (this == &rhs) return true;
+    if (hasHash() && rhs.hasHash() && hash() != rhs.hash()) {
+      return false;
+    }
+    if (type_ != rhs.type_) {
+      if (isPacked() && rhs.type_ == List) return PackedEquals(*this, rhs);
+      if (type_ == List && rhs.isPacked()) return PackedEquals(rhs, *this);
+      return false;
+    }
+    if (pending == nullptr || !IsNestedContainer(*this)) {
+      return type_ == Error || data_ == rhs.data_;
+    }
+    if (type_ == Obj) {
+      const auto& obj = std::get<Obj>(data_);
+      const auto& rhs_obj = std::get<Obj>(rhs.data_);
+      if (obj.size() != rhs_obj.size()) return false;
+      for (auto iter = obj.begin(), rhs_iter = rhs_obj.begin();
+           iter != obj.end(); ++iter, ++rhs_iter) {
+        if (iter->first != rhs_iter->first) return false;
+        pending->emplace_back(&iter->second, &rhs_iter->second);
+      }
+    } else {
+      const auto& list = std::get<List>(data_);
+      const auto& rhs_list = std::get<List>(rhs.data_);
+      if (list.size() != rhs_list.size()) return false;
+      for (size_t i = 0; i < list.size(); ++i) {
+        pending->emplace_back(&list[i], &rhs_list[i]);
+      }
+    }
+    return true;
+  }
+
+  // Deep copy into this empty node. Nested containers are filled from an
+  // explicit stack rather than through one copy constructor call per
+  // nesting level.
+  void copyFrom(const JsonNode& rhs) {
+    if (!IsNestedContainer(rhs)) {
+      type_ = rhs.type_;
+      data_ = rhs.data_;
+      return;
+    }
+    std::vector<std::pair<JsonNode*, const JsonNode*>> pending{{this, &rhs}};
+    while (!pending.empty()) {
+      auto [target, source] = pending.back();
+      pending.pop_back();
+      target->type_ = source->type_;
+      if (source->type_ == Obj) {
+        auto& obj = target->data_.emplace<Obj>();
+        for (const auto& [key, value] : std::get<Obj>(source->data_)) {
+          auto child = obj.try_emplace(obj.end(), key);
+          child->second.parent_ = target;
+          pending.emplace_back(&child->second, &value);
+        }
+      } else if (source->type_ == List) {
+        const auto& source_list = std::get<List>(source->data_);
+        auto& list = target->data_.emplace<List>(source_list.size());
+        for (size_t i = 0; i < list.size(); ++i) {
+          list[i].parent_ = target;
+          pending.emplace_back(&list[i], &source_list[i]);
+        }
+      } else {
+        target->data_ = source->data_;
+      }
+    }
+  }
+
+  static bool IsNestedContainer(const JsonNode& node) {
+    if (node.type_ == Obj) return !std::get<Obj>(node.data_).empty();
+    if (node.type_ == List) return !std::get<List>(node.data_).empty();
+    return false;
+  }
+
+  // Moves the non-empty containers among the children of `node` to
+  // `pending` and drops the rest, leaving `node` without children. They are
+  // detached first, as there is no tree left to keep up to date.
+  static void TakeChildren(JsonNode* node, ListType* pending) {
+    if (node->type_ == Obj) {
+      auto& obj = std::get<Obj>(node->data_);
+      for (auto& member : obj) {
+        if (IsNestedContainer(member.second)) {
+          member.second.parent_ = nullptr;
+          pending->push_back(move(member.second));
+        }
+      }
+      obj.clear();
+    } else if (node->type_ == List) {
+      auto& list = std::get<List>(node->data_);
+      for (auto& child : list) {
+        if (IsNestedContainer(child)) {
+          child.parent_ = nullptr;
+          pending->push_back(move(child));
+        }
+      }
+      list.clear();
+    }
+  }
+
+  // Tears down nested containers breadth first instead of through one
+  // destructor call per nesting level.
+  void releaseChildren() {
+    bool nested = false;
+    if (type_ == Obj) {
+      for (const auto& member : std::get<Obj>(data_)) {
+        if ((nested = IsNestedContainer(member.second))) break;
+      }
+    } else if (type_ == List) {
+      for (const auto& child : std::get<List>(data_)) {
+        if ((nested = IsNestedContainer(child))) break;
+      }
+    }
+    if (!nested) {
+      return;
+    }
+    ListType pending;
+    TakeChildren(this, &pending);
+    while (!pending.empty()) {
+      JsonNode node = move(pending.back());
+      pending.pop_back();
+      TakeChildren(&node, &pending);
+    }
+  }
+
+  // Mixes with the splitmix64 finalizer, so that every input bit reaches
+  // every output bit; std::hash of an integer is the integer itself.
+  static size_t HashCombine(size_t seed, size_t value) {
+    uint64_t mixed =
+        seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+    mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebULL;
+    return size_t(mixed ^ (mixed >> 31));
+  }
+
+  template <typename T>
+  static size_t ScalarHash(Type type, const T& value) {
+    return HashCombine(HashCombine(0, type), std::hash<T>()(value));
+  }
+
+  size_t computeHash() const {
+    size_t hash = HashCombine(0, isList() ? List : type_);
+    switch (type_) {
+      case Obj:
+        for (const auto& [key, value] : std::get<Obj>(data_)) {
+          hash = HashCombine(hash, std::hash<string>()(key));
+          hash = HashCombine(hash, value.hash());
+        }
+        return hash;
+      case List:
+        for (const auto& node : std::get<List>(data_)) {
+          hash = HashCombine(hash, node.hash());
+        }
+        return hash;
+      case IntList:
+        for (int64_t value : std::get<IntList>(data_)) {
+          hash = HashCombine(hash, ScalarHash(Int, value));
+        }
+        return hash;
+      case FloatList:
+        for (double value : std::get<FloatList>(data_)) {
+          hash = HashCombine(hash, ScalarHash(Float, value));
+        }
+        return hash;
+      case BoolList:
+        for (bool value : std::get<BoolList>(data_)) {
+          hash = HashCombine(hash, ScalarHash(Bool, value));
+        }
+        return hash;
+      case OwnedString:
+        return ScalarHash(OwnedString, std::get<OwnedString>(data_));
+      case Int:
+        return ScalarHash(Int, std::get<Int>(data_));
+      case Float:
+        return ScalarHash(Float, std::get<Float>(data_));
+      case Bool:
+        return ScalarHash(Bool, std::get<Bool>(data_));
+      default:
+        return hash;
+    }
+  }
+
+  // Converts a packed list into a regular list of nodes, taking over the
+  // nodes handed out by const access so that references to them stay valid.
+  // The value is unchanged, so a clean parent stays clean: the new nodes
+  // are hashed at once, as cheap as building them.
+  void unpack() {
+    if (!isPacked()) return;
+    Cache* cache = cache_.load(std::memory_order_relaxed);
+    ListType* nodes = cache ? cache->packed_nodes.exchange(nullptr) : nullptr;
+    ListType list = nodes ? move(*nodes) : PackedToNodes(*this);
+    delete nodes;
+    type_ = List;
+    data_ = move(list);
+    adoptChildren();
+    staleIndexes();
+    if (parent_ != nullptr && parent_->hasHash()) hash();
+  }
+
+  // Nodes mirroring the elements of a packed list for const element access,
+  // built on first use. The packed storage is left as it is, and concurrent
+  // readers agree on a single copy.
+  const ListType& packedNodes() const {
+    auto& packed_nodes = cache().packed_nodes;
+    ListType* nodes = packed_nodes.load(std::memory_order_acquire);
+    if (nodes == nullptr) {
+      auto built = std::make_unique<ListType>(PackedToNodes(*this));
+      if (packed_nodes.compare_exchange_strong(nodes, built.get(),
+                                               std::memory_order_acq_rel)) {
+        nodes = built.release();
+      }
+    }
+    return *nodes;
+  }
+
+  // Called whenever the packed storage changes.
+  void dropPackedNodes() {
+    if (Cache* cache = cache_.load(std::memory_order_relaxed)) {
+      delete cache->packed_nodes.exchange(nullptr);
+    }
+  }
+
+  static ListType PackedToNodes(const JsonNode& packed) {
+    ListType list;
+    switch (packed.type_) {
+      case IntList:
+        list.reserve(std::get<IntList>(packed.data_).size());
+        for (int64_t value : std::get<IntList>(packed.data_)) {
+          list.emplace_back(value);
+        }
+        break;
+      case FloatList:
+        list.reserve(std::get<FloatList>(packed.data_).size());
+        for (double value : std::get<FloatList>(packed.data_)) {
+          list.emplace_back(value);
+        }
+        break;
+      case BoolList:
+        list.reserve(std::get<BoolList>(packed.data_).size());
+        for (bool value : std::get<BoolList>(packed.data_)) {
+          list.emplace_back(value);
+        }
+        break;
+      default:
+        break;
+    }
+    return list;
+  }
+
+  static bool PackedEquals(const JsonNode& packed, const JsonNode& nodes) {
+    const auto& list = std::get<List>(nodes.data_);
+    size_t index = 0;
+    switch (packed.type_) {
+      case IntList:
+        if (list.size() != std::get<IntList>(packed.data_).size()) break;
+        for (int64_t value : std::get<IntList>(packed.data_)) {
+          const auto& node = list[index++];
+          if (!node.isInt() || node.toInt() != value) return false;
+        }
+        return true;
+      case FloatList:
+        if (list.size() != std::get<FloatList>(packed.data_).size()) break;
+        for (double value : std::get<FloatList>(packed.data_)) {
+          const auto& node = list[index++];
+          if (!node.isFloat() || node.toFloat() != value) return false;
+        }
+        return true;
+      case BoolList:
+        if (list.size() != std::get<BoolList>(packed.data_).size()) break;
+        for (bool value : std::get<BoolList>(packed.data_)) {
+          const auto& node = list[index++];
+          if (!node.isBool() || node.toBool() != value) return false;
+        }
+        return true;
+      default:
+        break;
+    }
+    return false;
+  }
+
   ObjType& asObj() {
+    touch();
     type_ = Obj;
     if (ObjType* v = std::get_if<ObjType>(&data_)) {
       return *v;
@@ -274,6 +1087,7 @@ struct JsonNode {
   }
 
   ListType& asList() {
+    touch();
     type_ = List;
     if (ListType* v = std::get_if<ListType>(&data_)) {
       return *v;
@@ -284,6 +1098,7 @@ struct JsonNode {
   }
 
   StringType& asString() {
+    touch();
     type_ = OwnedString;
     if (StringType* v = std::get_if<StringType>(&data_)) {
       return *v;
@@ -293,17 +1108,19 @@ struct JsonNode {
     return std::get<StringType>(data_);
   }
 
-  int& asInt() {
+  int64_t& asInt() {
+    touch();
     type_ = Int;
-    if (int* v = std::get_if<int>(&data_)) {
+    if (int64_t* v = std::get_if<int64_t>(&data_)) {
       return *v;
     } else {
-      data_ = int();
+      data_ = int64_t();
     }
-    return std::get<int>(data_);
+    return std::get<int64_t>(data_);
   }
 
   double& asFloat() {
+    touch();
     type_ = Float;
     if (double* v = std::get_if<double>(&data_)) {
       return *v;
@@ -314,6 +1131,7 @@ struct JsonNode {
   }
 
   bool& asBool() {
+    touch();
     type_ = Bool;
     if (bool* v = std::get_if<bool>(&data_)) {
       return *v;
@@ -325,407 +1143,772 @@ struct JsonNode {
 
  protected:
   Type type_;
-  std::variant<ObjType, ListType, StringType, int, double, bool> data_;
+  // Whether the cached hash is current; see touch().
+  mutable std::atomic<bool> clean_{false};
+  std::variant<ObjType, ListType, StringType, int64_t, double, bool,
+               std::nullptr_t, IntListType, FloatListType, BoolListType>
+      data_;
+  // The object or list holding this node, if any.
+  JsonNode* parent_ = nullptr;
+  // Owned; see cache().
+  mutable std::atomic<Cache*> cache_{nullptr};
   friend class Json;
+  friend class JsonPatch;
+  friend class JsonParallelWriter;
+  friend class ListIndex;
+  friend class ElementIterator;
 };
 
-#define BREAK_ON_FAILED(expr) \
-  if (!(expr)) {              \
-    valid_ = false;           \
-    break;                    \
+// Iterates the elements of a list, packed or not, as nodes. The elements of
+// a packed list are materialized one at a time inside the iterator, so a
+// reference obtained from it is only valid until the iterator moves on.
+class ElementIterator {
+ public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = JsonNode;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const JsonNode*;
+  using reference = const JsonNode&;
+
+  ElementIterator() = default;
+  ElementIterator(const JsonNode* list, size_t index)
+      : list_(list), index_(index) {}
+  // The materialized element is scratch and is not copied.
+  ElementIterator(const ElementIterator& rhs)
+      : list_(rhs.list_), index_(rhs.index_) {}
+  ElementIterator& operator=(const ElementIterator& rhs) {
+    list_ = rhs.list_;
+    index_ = rhs.index_;
+    return *this;
   }
 
-class Json {
- public:
-  Json(string str) : raw_str_(move(str)) { valid_ = parse(raw_str_, &root_); }
-  bool valid() { return valid_; }
-  JsonNodeRef<JsonNode> operator[](const string& key) { return root_[key]; }
-  JsonNodeRef<const JsonNode> at(const string& key) const {
-    return root_.at(key);
+  reference operator*() const {
+    if (list_->type_ == JsonNode::List) {
+      return std::get<JsonNode::List>(list_->data_)[index_];
+    }
+    if (!element_) element_.emplace();
+    switch (list_->type_) {
+      case JsonNode::IntList:
+        element_->data_.emplace<JsonNode::Int>(
+            std::get<JsonNode::IntList>(list_->data_)[index_]);
+        element_->type_ = JsonNode::Int;
+        break;
+      case JsonNode::FloatList:
+        element_->data_.emplace<JsonNode::Float>(
+            std::get<JsonNode::FloatList>(list_->data_)[index_]);
+        element_->type_ = JsonNode::Float;
+        break;
+      default:
+        element_->data_.emplace<JsonNode::Bool>(
+            std::get<JsonNode::BoolList>(list_->data_)[index_]);
+        element_->type_ = JsonNode::Bool;
+        break;
+    }
+    return *element_;
   }
-  string str() const { return root_.str(); }
-  JsonNodeRef<JsonNode> root() { return {&root_}; }
+  pointer operator->() const { return &**this; }
+  ElementIterator& operator++() {
+    ++index_;
+    return *this;
+  }
+  ElementIterator operator++(int) {
+    ElementIterator old(list_, index_);
+    ++index_;
+    return old;
+  }
+  bool operator==(const ElementIterator& rhs) const {
+    return list_ == rhs.list_ && index_ == rhs.index_;
+  }
+  bool operator!=(const ElementIterator& rhs) const { return !(*this == rhs); }
 
  private:
-  using cstr_t = string_view::const_iterator;
-  static void PrintView(string_view view) {
-    for (const char ch : view) {
-      putchar(ch);
-    }
-    putchar('\n');
+  const JsonNode* list_ = nullptr;
+  size_t index_ = 0;
+  // Built on the first dereference of a packed list element.
+  mutable std::optional<JsonNode> element_;
+};
+
+inline NodeRange<ElementIterator> JsonNode::elements() const {
+  if (!isList()) {
+    return {};
   }
+  size_t size = type_ == List ? std::get<List>(data_).size() : packedSize();
+  return {ElementIterator(this, 0), ElementIterator(this, size)};
+}
+
+inline ListIndex::ListIndex(const JsonNode* list, string_view path,
+                            std::mutex* mutex)
+    : list_(list), mutex_(mutex) {
+  while (true) {
+    size_t dot = path.find('.');
+    path_.emplace_back(path.substr(0, dot));
+    if (dot == string_view::npos) break;
+    path.remove_prefix(dot + 1);
+  }
+}
 
-  bool parse(const string& str, JsonNode* root) {
-    if (str.size() == 0) {
-      return false;
-    }
-    auto view = Trim(str);
-    // PrintView(view);
-    return parseObj(view.begin(), view.end(), root);
+inline size_t ListIndex::position(const JsonNode& key) const {
+  const size_t hash = key.hash();
+  std::lock_guard<std::mutex> lock(*mutex_);
+  if (stale_) {
+    build();
+  }
+  auto [begin, end] = positions_.equal_range(hash);
+  for (auto iter = begin; iter != end; ++iter) {
+    // Different values may share a hash.
+    const JsonNode* current = keyOf(iter->second);
+    if (current != nullptr && *current == key) return iter->second;
   }
+  return npos;
+}
 
-  static string_view Trim(const string& str) {
-    string_view view(str);
+inline JsonNodeRef<const JsonNode> ListIndex::find(const JsonNode& key) const {
+  size_t index = position(key);
+  if (index == npos) {
+    return {};
+  }
+  return {&std::get<JsonNode::List>(list_->data_)[index]};
+}
 
-    while (view.size() > 0 && std::isspace(view.front())) {
-      view.remove_prefix(1);
-    }
-    while (view.size() > 0 && std::isspace(view.back())) {
-      view.remove_suffix(1);
-    }
+inline size_t ListIndex::size() const {
+  std::lock_guard<std::mutex> lock(*mutex_);
+  if (stale_) {
+    build();
+  }
+  return positions_.size();
+}
+
+// Hashing the list first makes it and everything below it clean, so that
+// any later edit below it dirties the list again and stales the index.
+inline void ListIndex::build() const {
+  positions_.clear();
+  stale_ = false;
+  if (list_->type_ != JsonNode::List) {
+    return;
+  }
+  list_->hash();
+  const size_t count = std::get<JsonNode::List>(list_->data_).size();
+  positions_.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    add(i);
+  }
+}
 
-    return view;
+inline void ListIndex::add(size_t position) const {
+  const JsonNode* key = keyOf(position);
+  if (key == nullptr) {
+    return;
+  }
+  const size_t hash = key->hash();
+  auto [begin, end] = positions_.equal_range(hash);
+  for (auto iter = begin; iter != end; ++iter) {
+    const JsonNode* other = keyOf(iter->second);
+    if (other != nullptr && *other == *key) return;
   }
+  positions_.emplace(hash, position);
+}
+
+// Null when the element is gone or does not hold the path.
+inline const JsonNode* ListIndex::keyOf(size_t position) const {
+  if (list_->type_ != JsonNode::List ||
+      position >= std::get<JsonNode::List>(list_->data_).size()) {
+    return nullptr;
+  }
+  const JsonNode* node = &std::get<JsonNode::List>(list_->data_)[position];
+  for (const auto& name : path_) {
+    if (node->type_ != JsonNode::Obj) return nullptr;
+    const auto& obj = std::get<JsonNode::Obj>(node->data_);
+    auto iter = obj.find(name);
+    if (iter == obj.end()) return nullptr;
+    node = &iter->second;
+  }
+  return node;
+}
+
+// Selects the members the parser materializes. Paths are dotted member
+// names ("user.id"); lists are transparent, so "items.id" keeps the "id" of
+// every object in "items". Members outside the projection are skipped by
+// scanning for their end and are never converted into nodes.
+class JsonProjection {
+ public:
+  // Receives the dotted path of each member; returning false skips it.
+  using Predicate = std::function<bool(string_view path)>;
 
-  static string_view MakeView(cstr_t start, cstr_t finish) {
-    if (finish > start) {
-      return string_view(&*start, finish - start);
-    } else {
-      return string_view();
+ private:
+  struct Field {
+    std::map<string, Field, std::less<>> children;
+    // Keep the whole subtree below this member.
+    bool whole = false;
+  };
+
+ public:
+  JsonProjection(std::initializer_list<string> paths)
+      : JsonProjection(std::vector<string>(paths)) {}
+
+  explicit JsonProjection(const std::vector<string>& paths) {
+    for (const auto& path : paths) {
+      Field* field = &root_;
+      for (const auto& key : SplitString<string>(path, '.')) {
+        field = &field->children[key];
+      }
+      field->whole = true;
     }
   }
 
-  static string View2String(string_view view) {
-    return string(view.begin(), view.end());
-  }
+  explicit JsonProjection(Predicate predicate)
+      : predicate_(move(predicate)) {}
 
-  bool parseObj(cstr_t start, cstr_t finish, JsonNode* root) {
-    if (finish == findPairEdge(start, finish, '{', '}')) {
-      return false;
+  // Tracks the position of the parser inside the projection.
+  class Cursor {
+   public:
+    explicit Cursor(const JsonProjection* projection = nullptr)
+        : projection_(projection) {
+      if (projection_ && !projection_->predicate_) {
+        fields_.push_back(&projection_->root_);
+      }
     }
-    auto& obj_map = root->asObj();
 
-    cstr_t p_cur = start + 1;
+    bool enter(string_view key) {
+      if (projection_ == nullptr) {
+        return true;
+      }
+      if (projection_->predicate_) {
+        path_sizes_.push_back(path_.size());
+        if (!path_.empty()) path_.push_back('.');
+        path_.append(key.begin(), key.end());
+        if (projection_->predicate_(path_)) {
+          return true;
+        }
+        leave();
+        return false;
+      }
+      const Field* field = fields_.back();
+      if (field == nullptr) {
+        fields_.push_back(nullptr);
+        return true;
+      }
+      auto iter = field->children.find(key);
+      if (iter == field->children.end()) {
+        return false;
+      }
+      fields_.push_back(iter->second.whole ? nullptr : &iter->second);
+      return true;
+    }
+
+    void leave() {
+      if (projection_ == nullptr) {
+        return;
+      }
+      if (projection_->predicate_) {
+        path_.resize(path_sizes_.back());
+        path_sizes_.pop_back();
+      } else {
+        fields_.pop_back();
+      }
+    }
+
+   private:
+    const JsonProjection* projection_;
+    std::vector<const Field*> fields_;
+    string path_;
+    std::vector<size_t> path_sizes_;
+  };
+
+ private:
+  Field root_;
+  Predicate predicate_;
+};
+
+class Json {
+ public:
+  // Documents nested deeper than this are rejected as invalid, which bounds
+  // the parse stack on untrusted input.
+  static constexpr size_t kDefaultMaxDepth = 512;
+
+  Json(string str, size_t max_depth = kDefaultMaxDepth)
+      : raw_str_(move(str)), max_depth_(max_depth) {
+    valid_ = parse(raw_str_, &root_);
+  }
+  // Only builds the members selected by `projection`.
+  Json(string str, const JsonProjection& projection,
+       size_t max_depth = kDefaultMaxDepth)
+      : raw_str_(move(str)), cursor_(&projection), max_depth_(max_depth) {
+    valid_ = parse(raw_str_, &root_);
+    cursor_ = JsonProjection::Cursor();
+  }
+  bool valid() { return valid_; }
+  JsonNodeRef<JsonNode> operator[](const string& key) { return root_[key]; }
+  JsonNodeRef<const JsonNode> at(const string& key) const {
+    return root_.at(key);
+  }
+  string str() const { return root_.str(); }
+  JsonNodeRef<JsonNode> root() { return {&root_}; }
 
-    string_view last_key;
+ private:
+  using cstr_t = const char*;
+
+  enum State { Value, ValueOrEnd, Key, KeyOrEnd, Colon, CommaOrEnd, Done };
+
+  // An open object or list on the parse stack.
+  struct Frame {
+    JsonNode* node;
+    // The container is the value of an object member, whose projection
+    // scope closes together with it.
+    bool member;
+    // For a list read as floats that holds ints, which elements were ints,
+    // so that they are ints again if the list falls back to nodes.
+    std::vector<bool> ints;
+  };
+
+  static bool IsSpace(char ch) { return std::isspace(uint8_t(ch)); }
+
+  static bool IsDelimiter(char ch) {
+    return ch == ',' || ch == ']' || ch == '}' || ch == ':' || ch == '"' ||
+           ch == '[' || ch == '{' || IsSpace(ch);
+  }
 
-    JsonNode last_node;
+  static cstr_t SkipSpace(cstr_t start, cstr_t finish) {
+    while (start < finish && IsSpace(*start)) ++start;
+    return start;
+  }
 
-    for (; p_cur < finish - 1;) {
-      if (std::isspace(p_cur[0])) {
+  // Parses iteratively: nesting lives in `stack_`, not on the call stack.
+  bool parse(const string& str, JsonNode* root) {
+    cstr_t p_cur = str.data();
+    cstr_t finish = str.data() + str.size();
+    State state = Value;
+    // Where the next value is stored when it is not a list element.
+    JsonNode* target = root;
+    bool member = false;
+    string key;
+
+    stack_.clear();
+    for (;;) {
+      p_cur = SkipSpace(p_cur, finish);
+      if (p_cur == finish) {
+        break;
+      }
+      const char c = *p_cur;
+      if (state == ValueOrEnd && c == ']') {
+        state = closeContainer();
         ++p_cur;
         continue;
       }
-      if (*p_cur == '"') {
-        cstr_t key_edge = parseString(p_cur, finish);
-        BREAK_ON_FAILED(key_edge != finish);
-        last_key = MakeView(p_cur + 1, key_edge);
-        p_cur = key_edge + 1;
-      } else if (*p_cur == ':') {
-        p_cur = nextNoneSpacePos(p_cur + 1, finish);
-        BREAK_ON_FAILED(p_cur != finish);
-        p_cur = parseValue(p_cur, finish, &last_node);
-        BREAK_ON_FAILED(p_cur != finish);
+      if (state == KeyOrEnd && c == '}') {
+        state = closeContainer();
         ++p_cur;
-      } else if (*p_cur == ',') {
-        obj_map.insert({string(last_key), move(last_node)});
+        continue;
+      }
+
+      if (state == Value || state == ValueOrEnd) {
+        bool in_list = !stack_.empty() && stack_.back().node->isList();
+        if (c == '{' || c == '[') {
+          if (stack_.size() >= max_depth_) {
+            return fail(root);
+          }
+          JsonNode* node = in_list ? listSlot(&stack_.back()) : target;
+          if (c == '{') {
+            JsonNode::Reconstruct(node, JsonNode::ObjType());
+          } else {
+            JsonNode::Reconstruct(node, JsonNode::ListType());
+          }
+          stack_.push_back({node, !in_list && member, {}});
+          state = (c == '{' ? KeyOrEnd : ValueOrEnd);
+          ++p_cur;
+          continue;
+        }
+        JsonNode scalar;
+        p_cur = parseScalar(p_cur, finish, in_list ? &scalar : target);
+        if (p_cur == nullptr) {
+          return fail(root);
+        }
+        if (in_list) {
+          AppendToList(&stack_.back(), move(scalar));
+        } else if (member) {
+          cursor_.leave();
+        }
+        state = afterValue();
+      } else if (state == Key || state == KeyOrEnd) {
+        if (c != '"') {
+          return fail(root);
+        }
+        cstr_t key_edge = parseString(p_cur, finish, &key);
+        if (key_edge == nullptr) {
+          return fail(root);
+        }
+        p_cur = key_edge + 1;
+        state = Colon;
+      } else if (state == Colon) {
+        if (c != ':') {
+          return fail(root);
+        }
+        p_cur = SkipSpace(p_cur + 1, finish);
+        auto& obj = std::get<JsonNode::Obj>(stack_.back().node->data_);
+        bool entered = cursor_.enter(key);
+        auto inserted = entered ? obj.try_emplace(move(key))
+                                : std::make_pair(obj.end(), false);
+        if (!inserted.second) {
+          // Outside the projection, or a repeated key whose first value
+          // is kept.
+          if (entered) cursor_.leave();
+          p_cur = skipValue(p_cur, finish);
+          if (p_cur == nullptr) {
+            return fail(root);
+          }
+          state = CommaOrEnd;
+          continue;
+        }
+        target = &inserted.first->second;
+        target->parent_ = stack_.back().node;
+        member = true;
+        state = Value;
+      } else if (state == CommaOrEnd) {
+        bool in_obj = stack_.back().node->isObj();
+        if (c == ',') {
+          state = (in_obj ? Key : Value);
+        } else if (c == (in_obj ? '}' : ']')) {
+          state = closeContainer();
+        } else {
+          return fail(root);
+        }
         ++p_cur;
       } else {
-        BREAK_ON_FAILED(false);
+        return fail(root);
       }
     }
+    return state == Done ? true : fail(root);
+  }
 
-    if (valid_ && last_key.size() && !last_node.isType(JsonNode::Error)) {
-      obj_map.insert({string(last_key), move(last_node)});
-    } else {
-      root->type_ = JsonNode::Error;
-      valid_ = false;
-    }
-
-    return valid_;
+  bool fail(JsonNode* root) {
+    stack_.clear();
+    *root = JsonNode();
+    return false;
   }
 
-  cstr_t nextBlockPos(cstr_t start, cstr_t finish,
-                      std::function<bool(const char)> pred) {
-    while (start < finish) {
-      if (pred(*start)) {
-        return start;
-      } else {
-        ++start;
-      }
+  State afterValue() const { return stack_.empty() ? Done : CommaOrEnd; }
+
+  State closeContainer() {
+    if (stack_.back().member) {
+      cursor_.leave();
     }
-    return finish;
+    stack_.pop_back();
+    return afterValue();
   }
 
-  cstr_t nextNoneSpacePos(cstr_t start, cstr_t finish) {
-    while (*start && start < finish) {
-      if (!std::isspace(*start)) {
-        return start;
-      } else {
-        ++start;
+  static JsonNode* listSlot(Frame* frame) {
+    UnpackList(frame);
+    return &frame->node->append(JsonNode());
+  }
+
+  static void UnpackList(Frame* frame) {
+    frame->node->unpack();
+    if (!frame->ints.empty()) {
+      auto& nodes = std::get<JsonNode::List>(frame->node->data_);
+      for (size_t i = 0; i < nodes.size(); ++i) {
+        if (frame->ints[i]) {
+          nodes[i] = JsonNode(int64_t(nodes[i].toFloat()));
+        }
       }
+      frame->ints = {};
     }
-    return finish;
   }
 
-  cstr_t parseValue(cstr_t start, cstr_t finish, JsonNode* value_node) {
-    if (start >= finish) return finish;
-    cstr_t p_cur = start;
-    switch (*p_cur) {
-      case '"':
-        if (auto str_edge = parseString(p_cur, finish); str_edge != finish) {
-          string value = View2String(MakeView(p_cur + 1, str_edge));
-          JsonNode::Reconstruct(value_node, move(value));
-          return str_edge;
-        }
-        return finish;
-        break;
-      case '[':
-        if (auto edge = findPairEdge(p_cur, finish, '[', ']'); edge != finish) {
-          if (parseInList(p_cur, edge + 1, value_node)) {
-            return edge;
+  // Appends a scalar, keeping homogeneous int, float and bool lists packed.
+  // Lists mixing ints and floats are read as float lists; if other values
+  // follow, the list falls back to nodes and its ints are ints again.
+  static void AppendToList(Frame* frame, JsonNode&& value) {
+    JsonNode* list = frame->node;
+    switch (list->type_) {
+      case JsonNode::List:
+        if (std::get<JsonNode::List>(list->data_).empty()) {
+          if (value.isInt()) {
+            JsonNode::Reconstruct(list, JsonNode::IntListType{value.toInt()});
+            return;
+          } else if (value.isFloat()) {
+            JsonNode::Reconstruct(list,
+                                  JsonNode::FloatListType{value.toFloat()});
+            return;
+          } else if (value.isBool()) {
+            JsonNode::Reconstruct(list, JsonNode::BoolListType{value.toBool()});
+            return;
           }
         }
-        return finish;
         break;
-      case '{':
-        if (auto edge = findPairEdge(p_cur, finish, '{', '}'); edge != finish) {
-          if (parseObj(p_cur, edge + 1, value_node)) {
-            return edge;
-          }
+      case JsonNode::IntList:
+        if (value.isFloat()) {
+          const auto& ints = std::get<JsonNode::IntList>(list->data_);
+          JsonNode::FloatListType floats(ints.begin(), ints.end());
+          floats.push_back(value.toFloat());
+          frame->ints.assign(ints.size(), true);
+          frame->ints.push_back(false);
+          JsonNode::Reconstruct(list, move(floats));
+          return;
         }
-        return finish;
         break;
-      default:
-        if (auto val_edge = nextBlockPos(p_cur, finish,
-                                         [](const char ch) {
-                                           return ch == '}' || ch == '"' ||
-                                                  ch == '[' || ch == ']' ||
-                                                  ch == '{' || ch == ',' ||
-                                                  std::isspace(ch);
-                                         });
-            val_edge != finish) {
-          string_view val_view = MakeView(p_cur, val_edge);
-          if (std::regex_match(val_view.begin(), val_view.end(), BoolPat)) {
-            string bool_val(val_view.begin(), val_view.end());
-            value_node->asBool() = (bool_val == "true" ? true : false);
-            return val_edge - 1;
-          } else {
-            string num_str(val_view);
-            if (std::regex_match(num_str, IntPat)) {
-              value_node->asInt() = str2int(num_str);
-              return val_edge - 1;
-            } else if (std::regex_match(num_str, FloatPat)) {
-              value_node->asFloat() = atof(num_str.data());
-              return val_edge - 1;
-            }
+      case JsonNode::FloatList:
+        if (value.isNumber()) {
+          auto& floats = std::get<JsonNode::FloatList>(list->data_);
+          if (value.isInt() && frame->ints.empty()) {
+            frame->ints.resize(floats.size());
           }
+          if (!frame->ints.empty()) frame->ints.push_back(value.isInt());
+          floats.push_back(value.isInt() ? value.toInt() : value.toFloat());
+          return;
         }
-        return finish;
+        UnpackList(frame);
+        break;
+      default:
         break;
     }
+    list->push(move(value));
   }
 
-  bool parseInList(cstr_t start, cstr_t finish, JsonNode* node) {
-    node->type_ = JsonNode::List;
-    auto& node_list = node->asList();
-    auto list_view = MakeView(start, finish);
-
-    if (std::regex_match(list_view.begin(), list_view.end(), ObjListPat)) {
-      std::match_results<std::string_view::const_iterator> obj_match;
-
-      std::vector<string_view> obj_list;
-      while (std::regex_search(list_view.begin(), list_view.end(), obj_match,
-                               ObjItemPat)) {
-        auto matched = obj_match[1];
-        obj_list.push_back(matched.str());
-        list_view = MakeView(matched.second, list_view.end());
-      }
-
-      for (const auto& obj : obj_list) {
-        JsonNode obj_node;
-        if (parseObj(obj.cbegin(), obj.cend(), &obj_node)) {
-          node_list.push_back(move(obj_node));
-        } else {
-          node->type_ = JsonNode::Error;
-          return false;
-        }
-      }
-      return true;
-    } else if (std::regex_match(list_view.begin(), list_view.end(),
-                                StringListPat)) {
-      list_view.remove_prefix(1);
-      list_view.remove_suffix(1);
-
-      cstr_t str_start = finish, str_finish = finish;
-      bool in_string = false;
-      bool view_changed = false;
-
-      while (list_view[0] != '"') list_view.remove_prefix(1);
-
-      cstr_t p_edge = finish;
-      for (p_edge = findPairEdge(list_view.begin(), list_view.end(), '"', '"');
-           p_edge != list_view.end();) {
-        auto str_view = MakeView(list_view.begin() + 1, p_edge);
-        JsonNode str_node;
-        stringNodeHandle(str_view, &str_node);
-        node_list.push_back(move(str_node));
-        list_view = MakeView(p_edge + 1, list_view.end());
-      }
-
-      return true;
-    } else if (std::regex_match(list_view.begin(), list_view.end(),
-                                IntListPat)) {
-      list_view.remove_prefix(1);
-      list_view.remove_suffix(1);
-      std::vector<string_view> num_vec =
-          SplitString<string_view>(list_view, ',');
-
-      for (const auto& int_num : num_vec) {
-        JsonNode int_node;
-        string int_str(int_num);
-        int val = str2int(int_str);
-        int_node.asInt() = val;
-        node_list.push_back(move(int_node));
+  // Returns the position after the scalar, or nullptr when it is malformed.
+  cstr_t parseScalar(cstr_t start, cstr_t finish, JsonNode* node) {
+    if (*start == '"') {
+      string value;
+      cstr_t str_edge = parseString(start, finish, &value);
+      if (str_edge == nullptr) {
+        return nullptr;
       }
-      return true;
-    } else if (std::regex_match(list_view.begin(), list_view.end(),
-                                FloatListPat)) {
-      list_view.remove_prefix(1);
-      list_view.remove_suffix(1);
-      std::vector<string_view> num_vec =
-          SplitString<string_view>(list_view, ',');
-
-      for (const auto& float_num : num_vec) {
-        JsonNode float_node;
-        string float_str(float_num);
-        double val = atof(float_num.data());
-        float_node.asFloat() = val;
-        node_list.push_back(move(float_node));
-      }
-      return true;
-    } else if (std::regex_match(list_view.begin(), list_view.end(),
-                                BoolListPat)) {
-      list_view.remove_prefix(1);
-      list_view.remove_suffix(1);
-
-      std::vector<string_view> num_vec =
-          SplitString<string_view>(list_view, ',');
+      JsonNode::Reconstruct(node, move(value));
+      return str_edge + 1;
+    }
 
-      for (const auto& bool_val : num_vec) {
-        JsonNode bool_node;
-        bool val = (string(bool_val) == "true" ? true : false);
-        bool_node.asBool() = val;
-        node_list.push_back(move(bool_node));
+    cstr_t val_edge = start;
+    while (val_edge < finish && !IsDelimiter(*val_edge)) ++val_edge;
+    string_view val_view(start, val_edge - start);
+    if (val_view == "true" || val_view == "false") {
+      JsonNode::Reconstruct(node, val_view == "true");
+    } else if (val_view == "null") {
+      JsonNode::Reconstruct(node, nullptr);
+    } else if (IsIntToken(val_view)) {
+      // Out of range ints are rejected rather than wrapped.
+      int64_t value = 0;
+      if (!ParseInt64(val_view, &value)) {
+        return nullptr;
       }
-      return true;
+      JsonNode::Reconstruct(node, value);
+    } else if (IsFloatToken(val_view)) {
+      JsonNode::Reconstruct(node, atof(string(val_view).data()));
+    } else {
+      return nullptr;
     }
-    node->type_ = JsonNode::Error;
-    return false;
+    return val_edge;
   }
 
-  cstr_t parseString(cstr_t start, cstr_t finish) {
-    return findPairEdge(start, finish, '"', '"');
+  static bool IsDigits(string_view view, int base) {
+    if (view.empty()) return false;
+    for (const char ch : view) {
+      bool digit = (base == 2)    ? (ch == '0' || ch == '1')
+                   : (base == 16) ? std::isxdigit(uint8_t(ch))
+                                  : ('0' <= ch && ch <= '9');
+      if (!digit) return false;
+    }
+    return true;
   }
 
-  cstr_t findStrEdge(cstr_t start, cstr_t finish, bool ignore_espace = true) {
-    cstr_t p_cur = start;
-    if (*p_cur != '"') {
-      return finish;
+  static string_view SkipSign(string_view view) {
+    if (!view.empty() && (view[0] == '+' || view[0] == '-')) {
+      view.remove_prefix(1);
     }
+    return view;
+  }
 
-    for (++p_cur; p_cur < finish; ++p_cur) {
-      if (*p_cur == '\\') {
-        ++p_cur;
-      } else if (*p_cur == '"') {
-        return p_cur;
-      }
+  // Same language as IntPat: decimal, octal, 0x hex and 0b binary.
+  static bool IsIntToken(string_view view) {
+    view = SkipSign(view);
+    if (view.size() > 2 && view[0] == '0') {
+      char base = std::tolower(view[1]);
+      if (base == 'x') return IsDigits(view.substr(2), 16);
+      if (base == 'b') return IsDigits(view.substr(2), 2);
     }
-    return finish;
+    return IsDigits(view, 10);
   }
 
-  cstr_t findPairEdge(cstr_t start, cstr_t finish, char open, char close,
-                      bool ignore_espace = true) {
-    if (open == '"' && open == close) {
-      return findStrEdge(start, finish, ignore_espace);
+  // Same language as FloatPat: "1.5", ".5", "1.", "1e5", "1.5e-5".
+  static bool IsFloatToken(string_view view) {
+    view = SkipSign(view);
+    size_t int_len = 0;
+    while (int_len < view.size() && IsDigits(view.substr(int_len, 1), 10)) {
+      ++int_len;
     }
-
-    std::stack<char> stack;
-    auto p_cur = start;
-    if (p_cur >= finish || *p_cur != open) {
-      return finish;
+    string_view rest = view.substr(int_len);
+    if (int_len == 0) {
+      return rest.size() > 1 && rest[0] == '.' && IsDigits(rest.substr(1), 10);
     }
+    if (!rest.empty() && rest[0] == '.') {
+      rest.remove_prefix(1);
+      while (!rest.empty() && IsDigits(rest.substr(0, 1), 10)) {
+        rest.remove_prefix(1);
+      }
+    }
+    if (rest.empty()) return true;
+    if (std::tolower(rest[0]) != 'e') return false;
+    return IsDigits(SkipSign(rest.substr(1)), 10);
+  }
 
-    stack.push(open);
-
-    ++p_cur;
-    for (; p_cur < finish;) {
-      if (*p_cur == '"') {
-        if (p_cur = findStrEdge(p_cur, finish, ignore_espace);
-            p_cur == finish) {
-          return finish;
-        }
-      } else if (*p_cur == close) {
-        stack.pop();
-      } else if (*p_cur == open) {
-        stack.push(open);
+  // Finds the end of the value at `start` without building it, checking it
+  // against the same grammar as parse() and the depth limit. Returns nullptr
+  // when malformed.
+  cstr_t skipValue(cstr_t start, cstr_t finish) {
+    skip_stack_.clear();
+    State state = Value;
+    cstr_t p_cur = start;
+    do {
+      p_cur = SkipSpace(p_cur, finish);
+      if (p_cur == finish) {
+        return nullptr;
       }
-      if (stack.size() == 0) {
-        return p_cur;
+      const char c = *p_cur;
+      if ((state == ValueOrEnd && c == ']') ||
+          (state == KeyOrEnd && c == '}')) {
+        skip_stack_.pop_back();
+        state = CommaOrEnd;
+        ++p_cur;
+        continue;
       }
-      ++p_cur;
-    }
-    return finish;
+      switch (state) {
+        case Value:
+        case ValueOrEnd:
+          if (c == '{' || c == '[') {
+            if (stack_.size() + skip_stack_.size() >= max_depth_) {
+              return nullptr;
+            }
+            skip_stack_.push_back(c);
+            state = (c == '{' ? KeyOrEnd : ValueOrEnd);
+            ++p_cur;
+          } else {
+            if ((p_cur = skipScalar(p_cur, finish)) == nullptr) {
+              return nullptr;
+            }
+            state = CommaOrEnd;
+          }
+          break;
+        case Key:
+        case KeyOrEnd:
+          if (c != '"' || (p_cur = skipString(p_cur, finish)) == nullptr) {
+            return nullptr;
+          }
+          ++p_cur;
+          state = Colon;
+          break;
+        case Colon:
+          if (c != ':') {
+            return nullptr;
+          }
+          ++p_cur;
+          state = Value;
+          break;
+        default: {
+          bool in_obj = skip_stack_.back() == '{';
+          if (c == ',') {
+            state = (in_obj ? Key : Value);
+          } else if (c == (in_obj ? '}' : ']')) {
+            skip_stack_.pop_back();
+          } else {
+            return nullptr;
+          }
+          ++p_cur;
+        }
+      }
+    } while (!skip_stack_.empty());
+    return p_cur;
   }
 
-  void stringNodeHandle(const string_view& str_view, JsonNode* str_node) {
-    auto& node_str = str_node->asString();
-    if (needTranslate(str_view)) {
-      node_str = str_view;
-    } else {
-      node_str = translate(str_view);
+  // Checks the scalar at `start` like parseScalar, without building it.
+  cstr_t skipScalar(cstr_t start, cstr_t finish) {
+    if (*start == '"') {
+      cstr_t str_edge = skipString(start, finish);
+      return str_edge == nullptr ? nullptr : str_edge + 1;
+    }
+    cstr_t val_edge = start;
+    while (val_edge < finish && !IsDelimiter(*val_edge)) ++val_edge;
+    string_view val_view(start, val_edge - start);
+    if (IsIntToken(val_view)) {
+      int64_t value = 0;
+      return ParseInt64(val_view, &value) ? val_edge : nullptr;
     }
+    if (val_view == "true" || val_view == "false" || val_view == "null" ||
+        IsFloatToken(val_view)) {
+      return val_edge;
+    }
+    return nullptr;
   }
 
-  bool needTranslate(const string_view& view) {
-    for (const auto c : view) {
-      if (c == '\\') {
-        return false;
+  // Scans the string at `start` once: validates UTF-8, decodes escapes
+  // straight into `value` and bulk-copies the runs between them. Returns
+  // the closing quote, or nullptr when the string is malformed.
+  static cstr_t parseString(cstr_t start, cstr_t finish, string* value) {
+    value->clear();
+    cstr_t run = start + 1;
+    cstr_t p_cur = run;
+    for (;;) {
+      p_cur += SkipPlainAscii(p_cur, finish);
+      if (p_cur == finish) {
+        return nullptr;
+      }
+      const char c = *p_cur;
+      if (c == '"') {
+        value->append(run, p_cur);
+        return p_cur;
+      } else if (c == '\\') {
+        value->append(run, p_cur);
+        if ((p_cur = DecodeJsonEscape(p_cur, finish, value)) == nullptr) {
+          return nullptr;
+        }
+        run = p_cur;
+      } else if (uint8_t(c) < 0x20) {
+        // Control characters must be escaped.
+        return nullptr;
+      } else {
+        size_t length = Utf8SequenceLength(p_cur, finish);
+        if (length == 0) {
+          return nullptr;
+        }
+        p_cur += length;
       }
     }
-    return true;
   }
 
-  string translate(const string_view& view) {
-    string builder;
-    for (auto c = view.begin(); c != view.end(); ++c) {
-      if (*c != '\\') {
-        builder.push_back(*c);
-        continue;
-      }
-      if (++c == view.end()) {
-        return builder;
+  // Checks the string at `start` like parseString, in place: escapes are
+  // validated but neither decoded nor copied. Returns the closing quote, or
+  // nullptr when the string is malformed.
+  static cstr_t skipString(cstr_t start, cstr_t finish) {
+    cstr_t p_cur = start + 1;
+    for (;;) {
+      p_cur += SkipPlainAscii(p_cur, finish);
+      if (p_cur == finish) {
+        return nullptr;
       }
-      switch (*c) {
-        case '\\':
-          builder.push_back('\\');
-          break;
-        case 'b':
-          builder.push_back('\b');
-          break;
-        case 'f':
-          builder.push_back('\f');
-          break;
-        case 'n':
-          builder.push_back('\n');
-          break;
-        case 'r':
-          builder.push_back('\r');
-          break;
-        case '"':
-          builder.push_back('"');
-          break;
-        case 't':
-          builder.push_back('\t');
-          break;
+      const char c = *p_cur;
+      if (c == '"') {
+        return p_cur;
+      } else if (c == '\\') {
+        if ((p_cur = DecodeJsonEscape(p_cur, finish, nullptr)) == nullptr) {
+          return nullptr;
+        }
+      } else if (uint8_t(c) < 0x20) {
+        return nullptr;
+      } else {
+        size_t length = Utf8SequenceLength(p_cur, finish);
+        if (length == 0) {
+          return nullptr;
+        }
+        p_cur += length;
       }
     }
-    return builder;
   }
 
   JsonNode root_;
   string raw_str_;
   bool valid_ = true;
+  JsonProjection::Cursor cursor_;
+  size_t max_depth_;
+  std::vector<Frame> stack_;
+  std::vector<char> skip_stack_;
 };
 
 }  // namespace json
+
+#endif
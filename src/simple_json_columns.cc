@@ -0,0 +1,366 @@
+#include "simple_json_columns.h"
+
+#include <charconv>
+
+#include "simple_json_text.h"
+
+namespace json {
+
+using std::string;
+using std::string_view;
+
+// Tracks the path of each scanned value, the same way append(JsonNode)
+// does for nodes.
+class JsonShredder::TextHandler {
+ public:
+  explicit TextHandler(JsonShredder* shredder) : shredder_(shredder) {}
+
+  void beginObject() { frames_.push_back({false, path_.size()}); }
+
+  void endObject() {
+    path_.resize(frames_.back().base);
+    frames_.pop_back();
+  }
+
+  void beginList() {
+    path_.append("[]");
+    frames_.push_back({true, path_.size()});
+    ++list_depth_;
+  }
+
+  void endList() {
+    path_.resize(frames_.back().base - 2);
+    frames_.pop_back();
+    --list_depth_;
+  }
+
+  void key(string_view raw) {
+    path_.resize(frames_.back().base);
+    if (!path_.empty()) path_.push_back('.');
+    // The scanner has already checked the escapes.
+    UnescapeJson(raw.substr(1, raw.size() - 2), &key_);
+    path_.append(key_);
+  }
+
+  void value(string_view raw) {
+    bool repeated = list_depth_ > 0;
+    switch (raw[0]) {
+      case '"':
+        UnescapeJson(raw.substr(1, raw.size() - 2), &shredder_->text_value_);
+        shredder_->addString(path_, repeated, shredder_->text_value_);
+        break;
+      case 't':
+        shredder_->addBool(path_, repeated, true);
+        break;
+      case 'f':
+        shredder_->addBool(path_, repeated, false);
+        break;
+      case 'n':
+        shredder_->addNull(path_, repeated);
+        break;
+      default: {
+        const char* finish = raw.data() + raw.size();
+        int64_t int_value = 0;
+        if (raw.find_first_of(".eE") == string_view::npos &&
+            std::from_chars(raw.data(), finish, int_value).ec == std::errc()) {
+          shredder_->addInt(path_, repeated, int_value);
+        } else {
+          double float_value = 0;
+          std::from_chars(raw.data(), finish, float_value);
+          shredder_->addFloat(path_, repeated, float_value);
+        }
+      }
+    }
+  }
+
+ private:
+  struct Frame {
+    bool is_list;
+    // Path length of the container, including the "[]" of a list.
+    size_t base;
+  };
+
+  JsonShredder* shredder_;
+  std::vector<Frame> frames_;
+  string path_;
+  string key_;
+  size_t list_depth_ = 0;
+};
+
+void JsonShredder::append(const JsonNode& record) {
+  struct Frame {
+    const JsonNode* node;
+    size_t base;
+    bool repeated;
+    JsonNode::ObjType::const_iterator member;
+    ElementIterator element;
+    ElementIterator element_end;
+  };
+  std::vector<Frame> stack;
+  string path;
+  const JsonNode* node = &record;
+  bool repeated = false;
+  while (node != nullptr) {
+    if (node->isObj()) {
+      stack.push_back(
+          {node, path.size(), repeated, node->items().begin(), {}, {}});
+    } else if (node->isType(JsonNode::List)) {
+      path.append("[]");
+      auto elements = node->elements();
+      stack.push_back(
+          {node, path.size(), true, {}, elements.begin(), elements.end()});
+    } else if (node->isPacked()) {
+      path.append("[]");
+      for (int64_t value : node->asIntSpan()) addInt(path, true, value);
+      for (double value : node->asDoubleSpan()) addFloat(path, true, value);
+      for (bool value : node->asBoolBits()) addBool(path, true, value);
+      path.resize(path.size() - 2);
+    } else if (node->isInt()) {
+      addInt(path, repeated, node->toInt());
+    } else if (node->isFloat()) {
+      addFloat(path, repeated, node->toFloat());
+    } else if (node->isBool()) {
+      addBool(path, repeated, node->toBool());
+    } else if (node->isString()) {
+      addString(path, repeated, node->toString());
+    } else if (node->isNull()) {
+      addNull(path, repeated);
+    }
+
+    // Move on to the next child of the innermost open container.
+    node = nullptr;
+    while (node == nullptr && !stack.empty()) {
+      Frame& frame = stack.back();
+      if (frame.node->isObj()) {
+        if (frame.member == frame.node->items().end()) {
+          path.resize(frame.base);
+          stack.pop_back();
+          continue;
+        }
+        path.resize(frame.base);
+        if (!path.empty()) path.push_back('.');
+        path.append(frame.member->first);
+        node = &(frame.member++)->second;
+      } else {
+        if (frame.element == frame.element_end) {
+          path.resize(frame.base - 2);
+          stack.pop_back();
+          continue;
+        }
+        path.resize(frame.base);
+        // Lists of nodes hand out their own elements, which stay put.
+        node = &*frame.element;
+        ++frame.element;
+      }
+      repeated = frame.repeated;
+    }
+  }
+  endRow();
+}
+
+bool JsonShredder::append(string_view text) {
+  TextHandler handler(this);
+  if (JsonScanner<TextHandler>(text, &handler).scan()) {
+    endRow();
+    return true;
+  }
+  discardRow();
+  return false;
+}
+
+size_t JsonShredder::appendLines(string_view text) {
+  size_t failed = 0;
+  while (!text.empty()) {
+    size_t line_end = text.find('\n');
+    string_view line = text.substr(0, line_end);
+    if (line.find_first_not_of(" \t\r") != string_view::npos && !append(line)) {
+      ++failed;
+    }
+    if (line_end == string_view::npos) break;
+    text.remove_prefix(line_end + 1);
+  }
+  return failed;
+}
+
+const JsonColumn* JsonShredder::column(const string& path,
+                                       JsonColumn::Type type) const {
+  auto iter = slots_.find(Key(path, KindOf(type)));
+  return iter == slots_.end() ? nullptr : &iter->second.column;
+}
+
+std::vector<std::pair<string, const JsonColumn*>> JsonShredder::columns()
+    const {
+  std::vector<std::pair<string, const JsonColumn*>> result;
+  result.reserve(slots_.size());
+  for (const auto& [key, slot] : slots_) {
+    result.emplace_back(key.first, &slot.column);
+  }
+  return result;
+}
+
+JsonShredder::Slot* JsonShredder::slot(const string& path,
+                                       JsonColumn::Type type, bool repeated) {
+  auto [iter, inserted] = slots_.try_emplace(Key(path, KindOf(type)));
+  Slot& slot = iter->second;
+  JsonColumn& column = slot.column;
+  if (inserted) {
+    column.type = type;
+    column.repeated = repeated;
+    slot.created_row = rows_;
+    if (repeated) {
+      column.row_offsets.assign(rows_ + 1, 0);
+    } else {
+      for (size_t i = 0; i < rows_; ++i) PushDefault(&column);
+      column.valid.assign(rows_, false);
+    }
+  }
+  if (slot.last_row != rows_) {
+    slot.last_row = rows_;
+    slot.row_start = column.size();
+    auto nulls = repeated ? row_nulls_.find(path) : row_nulls_.end();
+    if (nulls != row_nulls_.end()) {
+      for (size_t i = 0; i < nulls->second; ++i) PushDefault(&column);
+      column.valid.resize(column.size(), false);
+    }
+  } else if (!repeated) {
+    // A repeated member name; the first value is kept.
+    return nullptr;
+  }
+  return &slot;
+}
+
+void JsonShredder::addInt(const string& path, bool repeated, int64_t value) {
+  if (Slot* target = slot(path, JsonColumn::Int, repeated)) {
+    JsonColumn& column = target->column;
+    if (column.type == JsonColumn::Float) {
+      column.floats.push_back(value);
+    } else {
+      column.ints.push_back(value);
+    }
+    column.valid.push_back(true);
+  }
+}
+
+void JsonShredder::addFloat(const string& path, bool repeated, double value) {
+  if (Slot* target = slot(path, JsonColumn::Float, repeated)) {
+    JsonColumn& column = target->column;
+    if (column.type == JsonColumn::Int) {
+      column.floats.assign(column.ints.begin(), column.ints.end());
+      target->row_ints.swap(column.ints);
+      target->row_promoted = true;
+      column.type = JsonColumn::Float;
+    }
+    column.floats.push_back(value);
+    column.valid.push_back(true);
+  }
+}
+
+void JsonShredder::addBool(const string& path, bool repeated, bool value) {
+  if (Slot* target = slot(path, JsonColumn::Bool, repeated)) {
+    target->column.bools.push_back(value);
+    target->column.valid.push_back(true);
+  }
+}
+
+void JsonShredder::addString(const string& path, bool repeated,
+                             string_view value) {
+  if (Slot* target = slot(path, JsonColumn::String, repeated)) {
+    JsonColumn& column = target->column;
+    column.chars.append(value.data(), value.size());
+    column.str_offsets.push_back(column.chars.size());
+    column.valid.push_back(true);
+  }
+}
+
+void JsonShredder::addNull(const string& path, bool repeated) {
+  if (!repeated) {
+    return;
+  }
+  for (int kind : {JsonColumn::Int, JsonColumn::Bool, JsonColumn::String}) {
+    auto iter = slots_.find(Key(path, kind));
+    if (iter != slots_.end() && iter->second.last_row == rows_) {
+      JsonColumn& column = iter->second.column;
+      PushDefault(&column);
+      column.valid.push_back(false);
+    }
+  }
+  ++row_nulls_[path];
+}
+
+void JsonShredder::PushDefault(JsonColumn* column) {
+  switch (column->type) {
+    case JsonColumn::Int:
+      column->ints.push_back(0);
+      break;
+    case JsonColumn::Float:
+      column->floats.push_back(0.);
+      break;
+    case JsonColumn::Bool:
+      column->bools.push_back(false);
+      break;
+    case JsonColumn::String:
+      column->str_offsets.push_back(column->chars.size());
+      break;
+  }
+}
+
+void JsonShredder::Truncate(JsonColumn* column, size_t size) {
+  switch (column->type) {
+    case JsonColumn::Int:
+      column->ints.resize(size);
+      break;
+    case JsonColumn::Float:
+      column->floats.resize(size);
+      break;
+    case JsonColumn::Bool:
+      column->bools.resize(size);
+      break;
+    case JsonColumn::String:
+      column->chars.resize(column->str_offsets[size]);
+      column->str_offsets.resize(size + 1);
+      break;
+  }
+}
+
+void JsonShredder::endRow() {
+  for (auto& [key, slot] : slots_) {
+    JsonColumn& column = slot.column;
+    if (slot.row_promoted) {
+      slot.row_promoted = false;
+      slot.row_ints = {};
+    }
+    if (column.repeated) {
+      column.row_offsets.push_back(column.size());
+    } else if (slot.last_row != rows_) {
+      PushDefault(&column);
+      column.valid.push_back(false);
+    }
+  }
+  row_nulls_.clear();
+  ++rows_;
+}
+
+void JsonShredder::discardRow() {
+  for (auto iter = slots_.begin(); iter != slots_.end();) {
+    Slot& slot = iter->second;
+    if (slot.created_row == rows_) {
+      iter = slots_.erase(iter);
+      continue;
+    }
+    if (slot.last_row == rows_) {
+      if (slot.row_promoted) {
+        slot.column.ints = move(slot.row_ints);
+        slot.column.floats = {};
+        slot.column.type = JsonColumn::Int;
+        slot.row_promoted = false;
+      }
+      Truncate(&slot.column, slot.row_start);
+      slot.column.valid.resize(slot.column.repeated ? slot.row_start : rows_);
+      slot.last_row = SIZE_MAX;
+    }
+    ++iter;
+  }
+  row_nulls_.clear();
+}
+
+}  // namespace json
@@ -0,0 +1,126 @@
+#ifndef SIMPLE_JSON_COLUMNS
+#define SIMPLE_JSON_COLUMNS
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "simple_json.hpp"
+
+namespace json {
+
+// One typed column of shredded records. A path outside any list has one
+// slot per row, flagged in `valid`; rows where it is missing, null or of
+// another type hold a default value. A path under a list ("tags[]",
+// "items[].id") is repeated: the values of row r are the range
+// [row_offsets[r], row_offsets[r + 1]), with nested lists flattened, and
+// `valid` has one flag per value. A null element is stored as a default
+// value flagged false in each column of its path that has a value in the
+// same row, in list order.
+struct JsonColumn {
+  enum Type { Int, Float, Bool, String };
+
+  Type type = Int;
+  bool repeated = false;
+
+  std::vector<int64_t> ints;
+  std::vector<double> floats;
+  std::vector<bool> bools;
+  // Strings are concatenated in `chars`; value i spans
+  // [str_offsets[i], str_offsets[i + 1]).
+  string chars;
+  std::vector<uint64_t> str_offsets = {0};
+
+  std::vector<bool> valid;
+  std::vector<uint64_t> row_offsets = {0};
+
+  size_t size() const {
+    switch (type) {
+      case Int:
+        return ints.size();
+      case Float:
+        return floats.size();
+      case Bool:
+        return bools.size();
+      default:
+        return str_offsets.size() - 1;
+    }
+  }
+
+  string_view stringAt(size_t index) const {
+    return string_view(chars).substr(
+        str_offsets[index], str_offsets[index + 1] - str_offsets[index]);
+  }
+};
+
+// Shreds a stream of records into one contiguous column per path and value
+// type, so that scans and aggregations run over flat arrays. Ints and floats
+// at the same path share a column, which turns into floats once a float is
+// seen; strings and bools at that path get columns of their own.
+class JsonShredder {
+ public:
+  void append(const JsonNode& record);
+
+  // Shreds a record straight from its text without building nodes. A
+  // malformed record is dropped and false is returned.
+  bool append(string_view text);
+
+  // Shreds newline separated records, skipping blank lines. Returns the
+  // number of malformed records that were dropped.
+  size_t appendLines(string_view text);
+
+  size_t rows() const { return rows_; }
+
+  // Numbers are found under Int and Float alike.
+  const JsonColumn* column(const string& path, JsonColumn::Type type) const;
+
+  std::vector<std::pair<string, const JsonColumn*>> columns() const;
+
+ private:
+  struct Slot {
+    JsonColumn column;
+    // Last row that stored a value, and the column size before that row.
+    size_t last_row = SIZE_MAX;
+    size_t row_start = 0;
+    size_t created_row = 0;
+    // Set when the current row promoted the column to floats; its ints are
+    // kept until the row ends in case the row is discarded.
+    bool row_promoted = false;
+    std::vector<int64_t> row_ints;
+  };
+
+  using Key = std::pair<string, int>;
+
+  static int KindOf(JsonColumn::Type type) {
+    return type == JsonColumn::Float ? JsonColumn::Int : type;
+  }
+
+  class TextHandler;
+
+  Slot* slot(const string& path, JsonColumn::Type type, bool repeated);
+
+  void addInt(const string& path, bool repeated, int64_t value);
+  void addFloat(const string& path, bool repeated, double value);
+  void addBool(const string& path, bool repeated, bool value);
+  void addString(const string& path, bool repeated, string_view value);
+  void addNull(const string& path, bool repeated);
+
+  static void PushDefault(JsonColumn* column);
+  static void Truncate(JsonColumn* column, size_t size);
+
+  void endRow();
+  void discardRow();
+
+  std::map<Key, Slot> slots_;
+  // Null list elements per repeated path in the current row, for columns
+  // that get their first value of the row after them.
+  std::map<string, size_t> row_nulls_;
+  size_t rows_ = 0;
+  string text_value_;
+};
+
+}  // namespace json
+#endif
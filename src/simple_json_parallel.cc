@@ -0,0 +1,179 @@
+#include "simple_json_parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace json {
+
+using std::string;
+
+JsonParallelWriter::JsonParallelWriter(size_t threads) : threads_(threads) {
+  if (threads_ == 0) {
+    threads_ = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+std::vector<string> JsonParallelWriter::chunks(const JsonNode& node) const {
+  Plan plan;
+  if (threads_ == 1) {
+    plan.pieces.push_back(node.str());
+    return move(plan.pieces);
+  }
+  this->plan(node, &plan);
+  run(&plan);
+  return move(plan.pieces);
+}
+
+string JsonParallelWriter::str(const JsonNode& node) const {
+  auto pieces = chunks(node);
+  size_t total = 0;
+  for (const auto& piece : pieces) {
+    total += piece.size();
+  }
+  string builder;
+  builder.reserve(total);
+  for (const auto& piece : pieces) {
+    builder.append(piece);
+  }
+  return builder;
+}
+
+void JsonParallelWriter::plan(const JsonNode& root, Plan* plan) const {
+  // Several chunks per thread keep the threads busy when the children
+  // differ in size.
+  const size_t chunk_count = threads_ * 4;
+  // Small containers being descended into. Nesting is walked with an
+  // explicit stack, so deep trees cannot overflow the call stack.
+  struct Frame {
+    const JsonNode* node;
+    size_t index;
+    JsonNode::ObjType::const_iterator member;
+  };
+  std::vector<Frame> stack;
+  const JsonNode* node = &root;
+  while (node != nullptr) {
+    if (node->isType(JsonNode::List)) {
+      const auto& list = std::get<JsonNode::List>(node->data_);
+      Literal(plan, "[");
+      if (list.size() >= threads_) {
+        size_t chunk = (list.size() + chunk_count - 1) / chunk_count;
+        for (size_t begin = 0; begin < list.size(); begin += chunk) {
+          size_t end = std::min(begin + chunk, list.size());
+          Task(plan, [&list, begin, end](string* builder) {
+            for (size_t i = begin; i < end; ++i) {
+              if (i > 0) builder->append(", ");
+              list[i].str(builder);
+            }
+          });
+        }
+        Literal(plan, "]");
+      } else {
+        stack.push_back({node, 0, {}});
+      }
+    } else if (node->isObj()) {
+      const auto& obj = std::get<JsonNode::Obj>(node->data_);
+      Literal(plan, "{");
+      if (obj.size() >= threads_) {
+        size_t chunk = (obj.size() + chunk_count - 1) / chunk_count;
+        auto begin = obj.begin();
+        for (size_t index = 0; index < obj.size(); index += chunk) {
+          auto end = std::next(begin, std::min(chunk, obj.size() - index));
+          bool first = (index == 0);
+          Task(plan, [begin, end, first](string* builder) {
+            for (auto iter = begin; iter != end; ++iter) {
+              if (iter != begin || !first) builder->append(", ");
+              builder->push_back('"');
+              AppendEscapedJson(iter->first, builder);
+              builder->append("\": ");
+              iter->second.str(builder);
+            }
+          });
+          begin = end;
+        }
+        Literal(plan, "}");
+      } else {
+        stack.push_back({node, 0, obj.begin()});
+      }
+    } else if (node->isPacked() && node->packedSize() >= threads_) {
+      const size_t size = node->packedSize();
+      Literal(plan, "[");
+      size_t chunk = (size + chunk_count - 1) / chunk_count;
+      for (size_t begin = 0; begin < size; begin += chunk) {
+        size_t end = std::min(begin + chunk, size);
+        Task(plan, [node, begin, end](string* builder) {
+          node->packedStr(begin, end, builder);
+        });
+      }
+      Literal(plan, "]");
+    } else {
+      Literal(plan, "");
+      node->str(&plan->pieces.back());
+    }
+
+    // Move on to the next child of the innermost open container.
+    node = nullptr;
+    while (node == nullptr && !stack.empty()) {
+      Frame& frame = stack.back();
+      if (frame.node->isObj()) {
+        const auto& obj = std::get<JsonNode::Obj>(frame.node->data_);
+        if (frame.member == obj.end()) {
+          Literal(plan, "}");
+          stack.pop_back();
+          continue;
+        }
+        if (frame.index++ > 0) Literal(plan, ", ");
+        Literal(plan, "\"");
+        AppendEscapedJson(frame.member->first, &plan->pieces.back());
+        Literal(plan, "\": ");
+        node = &(frame.member++)->second;
+      } else {
+        const auto& list = std::get<JsonNode::List>(frame.node->data_);
+        if (frame.index == list.size()) {
+          Literal(plan, "]");
+          stack.pop_back();
+          continue;
+        }
+        if (frame.index > 0) Literal(plan, ", ");
+        node = &list[frame.index++];
+      }
+    }
+  }
+}
+
+void JsonParallelWriter::Literal(Plan* plan, const char* text) {
+  if (!plan->open_literal) {
+    plan->pieces.emplace_back();
+    plan->open_literal = true;
+  }
+  plan->pieces.back().append(text);
+}
+
+void JsonParallelWriter::Task(Plan* plan,
+                              std::function<void(string*)> task) {
+  plan->slots.push_back(plan->pieces.size());
+  plan->pieces.emplace_back();
+  plan->tasks.push_back(move(task));
+  plan->open_literal = false;
+}
+
+void JsonParallelWriter::run(Plan* plan) const {
+  std::atomic<size_t> next(0);
+  auto worker = [plan, &next] {
+    for (size_t i = next++; i < plan->tasks.size(); i = next++) {
+      plan->tasks[i](&plan->pieces[plan->slots[i]]);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  size_t extra = std::min(threads_, plan->tasks.size());
+  for (size_t i = 1; i < extra; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+}
+
+}  // namespace json
@@ -0,0 +1,50 @@
+#ifndef SIMPLE_JSON_PARALLEL
+#define SIMPLE_JSON_PARALLEL
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "simple_json.hpp"
+
+namespace json {
+
+// Serializes very large trees on several threads. Containers, packed lists
+// included, with at least as many children as threads are cut into chunks
+// that are formatted concurrently; smaller containers are descended into so
+// that a big list nested below them is still split. The output is byte-identical to
+// JsonNode::str(). Small documents are faster through str() directly.
+class JsonParallelWriter {
+ public:
+  // `threads` == 0 uses std::thread::hardware_concurrency().
+  explicit JsonParallelWriter(size_t threads = 0);
+
+  // Returns pieces whose concatenation is the serialized node, in order.
+  // Handy for vectored writes that avoid the final join.
+  std::vector<std::string> chunks(const JsonNode& node) const;
+
+  std::string str(const JsonNode& node) const;
+
+ private:
+  struct Plan {
+    std::vector<std::string> pieces;
+    // Task i fills pieces[slots[i]].
+    std::vector<size_t> slots;
+    std::vector<std::function<void(std::string*)>> tasks;
+    // Whether the last piece still takes literal text.
+    bool open_literal = false;
+  };
+
+  void plan(const JsonNode& root, Plan* plan) const;
+
+  static void Literal(Plan* plan, const char* text);
+
+  static void Task(Plan* plan, std::function<void(std::string*)> task);
+
+  void run(Plan* plan) const;
+
+  size_t threads_;
+};
+
+}  // namespace json
+#endif
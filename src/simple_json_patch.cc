@@ -0,0 +1,468 @@
+#include "simple_json_patch.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace json {
+
+using std::string;
+
+bool JsonPatch::Apply(JsonNode* doc, JsonNode&& patch) {
+  if (doc == nullptr || !patch.isType(JsonNode::List)) {
+    return false;
+  }
+  for (auto& operation : std::get<JsonNode::List>(patch.data_)) {
+    if (!applyOperation(doc, &operation)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool JsonPatch::MergeApply(JsonNode* doc, JsonNode&& patch) {
+  if (doc == nullptr || patch.isType(JsonNode::Error)) {
+    return false;
+  }
+  mergeInto(doc, move(patch));
+  return true;
+}
+
+bool JsonPatch::SplitPointer(const string& pointer,
+                             std::vector<string>* tokens) {
+  tokens->clear();
+  if (pointer.empty()) {
+    return true;
+  }
+  if (pointer[0] != '/') {
+    return false;
+  }
+  string token;
+  for (size_t i = 1; i <= pointer.size(); ++i) {
+    if (i == pointer.size() || pointer[i] == '/') {
+      tokens->push_back(move(token));
+      token.clear();
+    } else if (pointer[i] == '~') {
+      if (i + 1 == pointer.size()) return false;
+      char escaped = pointer[++i];
+      if (escaped == '0') {
+        token.push_back('~');
+      } else if (escaped == '1') {
+        token.push_back('/');
+      } else {
+        return false;
+      }
+    } else {
+      token.push_back(pointer[i]);
+    }
+  }
+  return true;
+}
+
+string JsonPatch::EscapePointerToken(const string& token) {
+  string builder;
+  builder.reserve(token.size());
+  for (const char c : token) {
+    if (c == '~') {
+      builder.append("~0");
+    } else if (c == '/') {
+      builder.append("~1");
+    } else {
+      builder.push_back(c);
+    }
+  }
+  return builder;
+}
+
+bool JsonPatch::applyOperation(JsonNode* doc, JsonNode* operation) {
+  if (!operation->isObj()) {
+    return false;
+  }
+  auto& members = std::get<JsonNode::Obj>(operation->data_);
+  auto op_iter = members.find("op");
+  auto path_iter = members.find("path");
+  if (op_iter == members.end() || !op_iter->second.isString() ||
+      path_iter == members.end() || !path_iter->second.isString()) {
+    return false;
+  }
+  const string& op = std::get<JsonNode::OwnedString>(op_iter->second.data_);
+
+  std::vector<string> path;
+  if (!SplitPointer(std::get<JsonNode::OwnedString>(path_iter->second.data_),
+                    &path)) {
+    return false;
+  }
+
+  if (op == "add" || op == "replace" || op == "test") {
+    auto value_iter = members.find("value");
+    if (value_iter == members.end()) {
+      return false;
+    }
+    JsonNode& value = value_iter->second;
+    if (op == "add") {
+      return addValue(doc, path, move(value));
+    }
+    JsonNode* target = resolve(doc, path, path.size());
+    if (target == nullptr) {
+      return false;
+    }
+    if (op == "replace") {
+      *target = move(value);
+      return true;
+    }
+    return TestEquals(*target, value);
+  }
+
+  if (op == "remove") {
+    JsonNode removed;
+    return removeValue(doc, path, &removed);
+  }
+
+  if (op == "move" || op == "copy") {
+    auto from_iter = members.find("from");
+    if (from_iter == members.end() || !from_iter->second.isString()) {
+      return false;
+    }
+    std::vector<string> from;
+    if (!SplitPointer(std::get<JsonNode::OwnedString>(from_iter->second.data_),
+                      &from)) {
+      return false;
+    }
+    if (op == "copy") {
+      JsonNode* source = resolve(doc, from, from.size());
+      if (source == nullptr) {
+        return false;
+      }
+      return addValue(doc, path, source->clone());
+    }
+    if (from == path) {
+      return resolve(doc, from, from.size()) != nullptr;
+    }
+    // A value cannot be moved into one of its own children.
+    if (path.size() > from.size() &&
+        std::equal(from.begin(), from.end(), path.begin())) {
+      return false;
+    }
+    JsonNode moved;
+    if (!removeValue(doc, from, &moved)) {
+      return false;
+    }
+    return addValue(doc, path, move(moved));
+  }
+
+  return false;
+}
+
+bool JsonPatch::TestEquals(const JsonNode& lhs, const JsonNode& rhs) {
+  std::vector<std::pair<const JsonNode*, const JsonNode*>> pending{
+      {&lhs, &rhs}};
+  while (!pending.empty()) {
+    auto [left, right] = pending.back();
+    pending.pop_back();
+    if (left->isNumber() && right->isNumber()) {
+      if (left->isInt() && right->isInt()) {
+        if (left->toInt() != right->toInt()) return false;
+      } else if ((left->isInt() ? left->toInt() : left->toFloat()) !=
+                 (right->isInt() ? right->toInt() : right->toFloat())) {
+        return false;
+      }
+    } else if (left->isObj() && right->isObj()) {
+      const auto& left_obj = std::get<JsonNode::Obj>(left->data_);
+      const auto& right_obj = std::get<JsonNode::Obj>(right->data_);
+      if (left_obj.size() != right_obj.size()) return false;
+      for (auto left_iter = left_obj.begin(), right_iter = right_obj.begin();
+           left_iter != left_obj.end(); ++left_iter, ++right_iter) {
+        if (left_iter->first != right_iter->first) return false;
+        pending.emplace_back(&left_iter->second, &right_iter->second);
+      }
+    } else if (left->isType(JsonNode::List) && right->isType(JsonNode::List)) {
+      const auto& left_list = std::get<JsonNode::List>(left->data_);
+      const auto& right_list = std::get<JsonNode::List>(right->data_);
+      if (left_list.size() != right_list.size()) return false;
+      for (size_t i = 0; i < left_list.size(); ++i) {
+        pending.emplace_back(&left_list[i], &right_list[i]);
+      }
+    } else if (left->isList() && right->isList()) {
+      // A packed side only holds scalars, compared on the spot since the
+      // iterators reuse their element.
+      auto left_list = left->elements();
+      auto right_list = right->elements();
+      auto left_iter = left_list.begin();
+      auto right_iter = right_list.begin();
+      for (; left_iter != left_list.end() && right_iter != right_list.end();
+           ++left_iter, ++right_iter) {
+        if (!TestEquals(*left_iter, *right_iter)) return false;
+      }
+      if (left_iter != left_list.end() || right_iter != right_list.end()) {
+        return false;
+      }
+    } else if (*left != *right) {
+      return false;
+    }
+  }
+  return true;
+}
+
+JsonNode* JsonPatch::resolve(JsonNode* doc, const std::vector<string>& tokens,
+                             size_t depth) {
+  JsonNode* node = doc;
+  for (size_t i = 0; i < depth && node != nullptr; ++i) {
+    const string& token = tokens[i];
+    if (node->isObj()) {
+      auto& obj = std::get<JsonNode::Obj>(node->data_);
+      auto iter = obj.find(token);
+      node = (iter == obj.end() ? nullptr : &iter->second);
+    } else if (node->isList()) {
+      node->unpack();
+      auto& list = std::get<JsonNode::List>(node->data_);
+      size_t index = 0;
+      if (!parseIndex(token, &index) || index >= list.size()) {
+        return nullptr;
+      }
+      node = &list[index];
+    } else {
+      return nullptr;
+    }
+  }
+  return node;
+}
+
+bool JsonPatch::parseIndex(const string& token, size_t* index) {
+  if (token.empty() || (token.size() > 1 && token[0] == '0')) {
+    return false;
+  }
+  size_t value = 0;
+  for (const char c : token) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    const size_t digit = c - '0';
+    if (value > (SIZE_MAX - digit) / 10) {
+      return false;
+    }
+    value = value * 10 + digit;
+  }
+  *index = value;
+  return true;
+}
+
+bool JsonPatch::addValue(JsonNode* doc, const std::vector<string>& tokens,
+                         JsonNode&& value) {
+  if (tokens.empty()) {
+    *doc = move(value);
+    return true;
+  }
+  JsonNode* parent = resolve(doc, tokens, tokens.size() - 1);
+  if (parent == nullptr) {
+    return false;
+  }
+  const string& token = tokens.back();
+  if (parent->isObj()) {
+    parent->touch();
+    JsonNode& slot = std::get<JsonNode::Obj>(parent->data_)[token];
+    slot = move(value);
+    slot.parent_ = parent;
+    return true;
+  } else if (parent->isList()) {
+    parent->unpack();
+    auto& list = std::get<JsonNode::List>(parent->data_);
+    size_t index = list.size();
+    if (token != "-" && (!parseIndex(token, &index) || index > list.size())) {
+      return false;
+    }
+    parent->touch();
+    if (index == list.size()) {
+      parent->append(move(value));
+    } else {
+      list.insert(list.begin() + index, move(value));
+      parent->adoptChildren();
+    }
+    return true;
+  }
+  return false;
+}
+
+bool JsonPatch::removeValue(JsonNode* doc, const std::vector<string>& tokens,
+                            JsonNode* removed) {
+  if (tokens.empty()) {
+    return false;
+  }
+  JsonNode* parent = resolve(doc, tokens, tokens.size() - 1);
+  if (parent == nullptr) {
+    return false;
+  }
+  const string& token = tokens.back();
+  if (parent->isObj()) {
+    auto& obj = std::get<JsonNode::Obj>(parent->data_);
+    auto iter = obj.find(token);
+    if (iter == obj.end()) {
+      return false;
+    }
+    parent->touch();
+    *removed = move(iter->second);
+    obj.erase(iter);
+    return true;
+  } else if (parent->isList()) {
+    parent->unpack();
+    auto& list = std::get<JsonNode::List>(parent->data_);
+    size_t index = 0;
+    if (!parseIndex(token, &index) || index >= list.size()) {
+      return false;
+    }
+    parent->touch();
+    *removed = move(list[index]);
+    list.erase(list.begin() + index);
+    return true;
+  }
+  return false;
+}
+
+// Nested objects are merged from an explicit stack, so deep patches cannot
+// overflow the call stack.
+void JsonPatch::mergeInto(JsonNode* target, JsonNode&& patch) {
+  std::vector<std::pair<JsonNode*, JsonNode*>> pending{{target, &patch}};
+  while (!pending.empty()) {
+    auto [node, source] = pending.back();
+    pending.pop_back();
+    if (!source->isObj()) {
+      *node = move(*source);
+      continue;
+    }
+    if (!node->isObj()) {
+      JsonNode::Reconstruct(node, JsonNode::ObjType());
+    }
+    node->touch();
+    auto& obj = std::get<JsonNode::Obj>(node->data_);
+    for (auto& [key, value] : std::get<JsonNode::Obj>(source->data_)) {
+      if (value.isNull()) {
+        obj.erase(key);
+      } else {
+        JsonNode& slot = obj[key];
+        slot.parent_ = node;
+        pending.emplace_back(&slot, &value);
+      }
+    }
+  }
+}
+
+JsonNode JsonPatch::Diff(const JsonNode& from, const JsonNode& to) {
+  JsonNode patch = JsonNode::ListType();
+  string path;
+  diffInto(from, to, &path, &patch);
+  return patch;
+}
+
+JsonNode JsonPatch::MakeOperation(const char* op, const string& path) {
+  JsonNode operation;
+  operation.insert("op", JsonNode(op));
+  operation.insert("path", JsonNode(path));
+  return operation;
+}
+
+// Walks both trees in step with an explicit stack of the object and list
+// pairs being compared, emitting operations in depth-first order.
+void JsonPatch::diffInto(const JsonNode& from, const JsonNode& to,
+                         string* path, JsonNode* patch) {
+  struct Frame {
+    const JsonNode* from;
+    const JsonNode* to;
+    // Length of the path of the pair, which its children extend.
+    size_t path_size;
+    JsonNode::ObjType::const_iterator from_member;
+    JsonNode::ObjType::const_iterator to_member;
+    // Position in a pair of lists, and their sizes.
+    size_t index;
+    size_t from_size;
+    size_t to_size;
+  };
+  std::vector<Frame> stack;
+  auto list_size = [](const JsonNode& list) {
+    return list.isType(JsonNode::List)
+               ? std::get<JsonNode::List>(list.data_).size()
+               : list.packedSize();
+  };
+  // Opens a frame for a pair of containers, or emits the replacement of a
+  // value that differs otherwise.
+  auto visit = [&stack, &list_size, path, patch](const JsonNode& from_node,
+                                                 const JsonNode& to_node) {
+    if (from_node.hash() == to_node.hash()) {
+      return;
+    }
+    if (from_node.isObj() && to_node.isObj()) {
+      const auto& from_obj = std::get<JsonNode::Obj>(from_node.data_);
+      const auto& to_obj = std::get<JsonNode::Obj>(to_node.data_);
+      stack.push_back({&from_node, &to_node, path->size(), from_obj.begin(),
+                       to_obj.begin(), 0, 0, 0});
+    } else if (from_node.isList() && to_node.isList()) {
+      stack.push_back({&from_node, &to_node, path->size(), {}, {}, 0,
+                       list_size(from_node), list_size(to_node)});
+    } else {
+      auto operation = MakeOperation("replace", *path);
+      operation.insert("value", JsonNode(to_node));
+      patch->push(move(operation));
+    }
+  };
+
+  visit(from, to);
+  while (!stack.empty()) {
+    Frame& frame = stack.back();
+    path->resize(frame.path_size);
+    if (frame.from->isObj()) {
+      const auto& from_obj = std::get<JsonNode::Obj>(frame.from->data_);
+      const auto& to_obj = std::get<JsonNode::Obj>(frame.to->data_);
+      auto& from_iter = frame.from_member;
+      auto& to_iter = frame.to_member;
+      if (from_iter == from_obj.end() && to_iter == to_obj.end()) {
+        stack.pop_back();
+        continue;
+      }
+      bool take_from = to_iter == to_obj.end() ||
+                       (from_iter != from_obj.end() &&
+                        from_iter->first < to_iter->first);
+      bool take_to = from_iter == from_obj.end() ||
+                     (to_iter != to_obj.end() &&
+                      to_iter->first < from_iter->first);
+      const string& key = take_from ? from_iter->first : to_iter->first;
+      path->push_back('/');
+      path->append(EscapePointerToken(key));
+      if (take_from) {
+        patch->push(MakeOperation("remove", *path));
+        ++from_iter;
+      } else if (take_to) {
+        auto operation = MakeOperation("add", *path);
+        operation.insert("value", JsonNode(to_iter->second));
+        patch->push(move(operation));
+        ++to_iter;
+      } else {
+        // May push a frame, after which `frame` is not to be used.
+        const JsonNode& from_child = (from_iter++)->second;
+        const JsonNode& to_child = (to_iter++)->second;
+        visit(from_child, to_child);
+      }
+      continue;
+    }
+
+    // Elements are matched by index: trailing elements are removed back to
+    // front so that earlier indices stay valid, extra ones are appended.
+    // Packed lists are read in place through ElementIterator; the inputs are
+    // left as they are.
+    if (frame.index < frame.from_size && frame.index < frame.to_size) {
+      ElementIterator from_element(frame.from, frame.index);
+      ElementIterator to_element(frame.to, frame.index);
+      path->append("/" + std::to_string(frame.index++));
+      // May push a frame, after which `frame` is not to be used.
+      visit(*from_element, *to_element);
+      continue;
+    }
+    for (size_t i = frame.from_size; i > frame.index; --i) {
+      patch->push(MakeOperation("remove", *path + "/" + std::to_string(i - 1)));
+    }
+    for (size_t i = frame.index; i < frame.to_size; ++i) {
+      auto operation = MakeOperation("add", *path + "/-");
+      operation.insert("value", JsonNode(*ElementIterator(frame.to, i)));
+      patch->push(move(operation));
+    }
+    stack.pop_back();
+  }
+}
+
+}  // namespace json
@@ -0,0 +1,64 @@
+#ifndef SIMPLE_JSON_PATCH
+#define SIMPLE_JSON_PATCH
+
+#include <string>
+#include <vector>
+
+#include "simple_json.hpp"
+
+namespace json {
+
+// In-place application of RFC 6902 (JSON Patch) and RFC 7396 (JSON Merge
+// Patch) documents. Values are moved out of the patch into the target tree,
+// and members the patch does not address are left untouched.
+class JsonPatch {
+ public:
+  // `patch` must be a list of operation objects. Operations are applied in
+  // order; on the first failing operation false is returned and the
+  // operations before it stay applied.
+  static bool Apply(JsonNode* doc, JsonNode&& patch);
+
+  static bool MergeApply(JsonNode* doc, JsonNode&& patch);
+
+  // Splits a JSON Pointer (RFC 6901) into unescaped reference tokens.
+  static bool SplitPointer(const std::string& pointer,
+                           std::vector<std::string>* tokens);
+
+  static std::string EscapePointerToken(const std::string& token);
+
+  // Returns a JSON Patch that turns `from` into `to`. Subtrees whose cached
+  // structural hashes match are taken as equal and skipped without being
+  // walked, so a collision of the 64-bit hashes, however unlikely, would
+  // hide the changes below it. List elements are compared by position.
+  static JsonNode Diff(const JsonNode& from, const JsonNode& to);
+
+ private:
+  static bool applyOperation(JsonNode* doc, JsonNode* operation);
+
+  // Equality for the "test" operation: like operator==, except that numbers
+  // are equal when numerically equal, so 1 matches 1.0 (RFC 6902 4.6).
+  static bool TestEquals(const JsonNode& lhs, const JsonNode& rhs);
+
+  static JsonNode* resolve(JsonNode* doc,
+                           const std::vector<std::string>& tokens,
+                           size_t depth);
+
+  static bool parseIndex(const std::string& token, size_t* index);
+
+  static bool addValue(JsonNode* doc, const std::vector<std::string>& tokens,
+                       JsonNode&& value);
+
+  static bool removeValue(JsonNode* doc,
+                          const std::vector<std::string>& tokens,
+                          JsonNode* removed);
+
+  static void mergeInto(JsonNode* target, JsonNode&& patch);
+
+  static JsonNode MakeOperation(const char* op, const std::string& path);
+
+  static void diffInto(const JsonNode& from, const JsonNode& to,
+                       std::string* path, JsonNode* patch);
+};
+
+}  // namespace json
+#endif
@@ -0,0 +1,483 @@
+#include "simple_json_stream.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(SIMPLE_JSON_WITH_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "simple_json_utils.h"
+
+namespace json {
+
+using std::string;
+using std::string_view;
+
+namespace {
+
+// Hands decompressed chunks from the reading thread to the parsing thread.
+// Drained chunks come back through recycle() so that their buffers are
+// reused instead of reallocated.
+class ChunkQueue {
+ public:
+  explicit ChunkQueue(size_t capacity) : capacity_(capacity) {}
+
+  // Producer side. push() blocks while the queue is full and returns false
+  // once the consumer has given up.
+  void acquire(string* chunk) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!spare_.empty()) {
+      chunk->swap(spare_.back());
+      spare_.pop_back();
+    }
+    chunk->clear();
+  }
+
+  bool push(string* chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock,
+                   [this] { return cancelled_ || chunks_.size() < capacity_; });
+    if (cancelled_) {
+      return false;
+    }
+    chunks_.push_back(std::move(*chunk));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_one();
+  }
+
+  // Consumer side. pop() blocks until a chunk arrives and returns false
+  // once the producer has closed the queue and it is drained.
+  bool pop(string* chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || !chunks_.empty(); });
+    if (chunks_.empty()) {
+      return false;
+    }
+    chunk->swap(chunks_.front());
+    chunks_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void recycle(string* chunk) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    spare_.push_back(std::move(*chunk));
+  }
+
+  void cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+    not_full_.notify_one();
+  }
+
+ private:
+  const size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<string> chunks_;
+  std::vector<string> spare_;
+  bool closed_ = false;
+  bool cancelled_ = false;
+};
+
+// Blocks of raw input, with a look at the first one before it is consumed.
+class InputBlocks {
+ public:
+  InputBlocks(std::istream* stream, size_t block_size)
+      : stream_(stream), buffer_(block_size, '\0') {}
+
+  // Returns an empty block at the end of the input.
+  string_view next() {
+    if (primed_) {
+      primed_ = false;
+    } else {
+      stream_->read(&buffer_[0], buffer_.size());
+      size_ = stream_->gcount();
+    }
+    return string_view(buffer_.data(), size_);
+  }
+
+  string_view peek() {
+    string_view block = next();
+    primed_ = true;
+    return block;
+  }
+
+  bool failed() const { return stream_->bad(); }
+
+ private:
+  std::istream* stream_;
+  string buffer_;
+  size_t size_ = 0;
+  bool primed_ = false;
+};
+
+// Fills chunks of `chunk_size` bytes and hands the full ones over.
+class ChunkFiller {
+ public:
+  ChunkFiller(ChunkQueue* queue, size_t chunk_size)
+      : queue_(queue), chunk_size_(chunk_size) {
+    next();
+  }
+
+  char* data() { return &chunk_[0] + filled_; }
+  size_t room() const { return chunk_size_ - filled_; }
+
+  // Accounts for `size` bytes written at data().
+  bool commit(size_t size) {
+    filled_ += size;
+    return filled_ < chunk_size_ || flush();
+  }
+
+  bool flush() {
+    if (filled_ == 0) {
+      return true;
+    }
+    chunk_.resize(filled_);
+    if (!queue_->push(&chunk_)) {
+      return false;
+    }
+    next();
+    return true;
+  }
+
+ private:
+  void next() {
+    queue_->acquire(&chunk_);
+    chunk_.resize(chunk_size_);
+    filled_ = 0;
+  }
+
+  ChunkQueue* queue_;
+  const size_t chunk_size_;
+  string chunk_;
+  size_t filled_ = 0;
+};
+
+bool CopyPlain(InputBlocks* input, ChunkFiller* output) {
+  for (string_view block = input->next(); !block.empty();
+       block = input->next()) {
+    while (!block.empty()) {
+      size_t size = std::min(block.size(), output->room());
+      std::memcpy(output->data(), block.data(), size);
+      block.remove_prefix(size);
+      if (!output->commit(size)) {
+        return false;
+      }
+    }
+  }
+  return output->flush();
+}
+
+bool InflateGzip(InputBlocks* input, ChunkFiller* output) {
+  z_stream stream;
+  std::memset(&stream, 0, sizeof(stream));
+  // 15 window bits, plus 32 to accept both gzip and zlib headers.
+  if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+    return false;
+  }
+  bool ok = true;
+  bool stream_end = false;
+  bool output_full = false;
+  while (ok) {
+    // Pending output is drained before more input is read.
+    if (stream.avail_in == 0 && !output_full) {
+      string_view block = input->next();
+      if (block.empty()) {
+        break;
+      }
+      if (stream_end) {
+        // Concatenated members, as written by `cat a.gz b.gz`.
+        inflateReset(&stream);
+        stream_end = false;
+      }
+      stream.next_in =
+          reinterpret_cast<Bytef*>(const_cast<char*>(block.data()));
+      stream.avail_in = block.size();
+    }
+    const size_t room = output->room();
+    stream.next_out = reinterpret_cast<Bytef*>(output->data());
+    stream.avail_out = room;
+    int ret = inflate(&stream, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      stream_end = true;
+      if (stream.avail_in > 0) {
+        inflateReset(&stream);
+        stream_end = false;
+      }
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      ok = false;
+    }
+    output_full = stream.avail_out == 0;
+    ok = ok && output->commit(room - stream.avail_out);
+  }
+  inflateEnd(&stream);
+  // A missing stream end means truncated input.
+  return ok && stream_end && output->flush();
+}
+
+#if defined(SIMPLE_JSON_WITH_ZSTD)
+bool DecompressZstd(InputBlocks* input, ChunkFiller* output) {
+  ZSTD_DStream* stream = ZSTD_createDStream();
+  if (stream == nullptr) {
+    return false;
+  }
+  ZSTD_initDStream(stream);
+  bool ok = true;
+  bool output_full = false;
+  // Zero once the last frame is complete.
+  size_t hint = 0;
+  ZSTD_inBuffer in = {nullptr, 0, 0};
+  while (ok) {
+    if (in.pos == in.size && !output_full) {
+      string_view block = input->next();
+      if (block.empty()) {
+        break;
+      }
+      in = {block.data(), block.size(), 0};
+    }
+    ZSTD_outBuffer out = {output->data(), output->room(), 0};
+    hint = ZSTD_decompressStream(stream, &out, &in);
+    if (ZSTD_isError(hint)) {
+      ok = false;
+      break;
+    }
+    output_full = out.pos == out.size;
+    ok = output->commit(out.pos);
+  }
+  ZSTD_freeDStream(stream);
+  return ok && hint == 0 && output->flush();
+}
+#endif
+
+JsonRecordReader::Compression DetectCompression(string_view head) {
+  if (head.size() >= 2 && head[0] == '\x1f' && head[1] == '\x8b') {
+    return JsonRecordReader::Gzip;
+  }
+  if (head.substr(0, 4) == string_view("\x28\xb5\x2f\xfd", 4)) {
+    return JsonRecordReader::Zstd;
+  }
+  return JsonRecordReader::None;
+}
+
+bool Decompress(std::istream* stream, const JsonRecordReader::Options& options,
+                ChunkQueue* queue) {
+  InputBlocks input(stream, options.chunk_size);
+  ChunkFiller output(queue, options.chunk_size);
+  JsonRecordReader::Compression compression = options.compression;
+  if (compression == JsonRecordReader::Detect) {
+    compression = DetectCompression(input.peek());
+  }
+  bool ok = false;
+  switch (compression) {
+    case JsonRecordReader::Gzip:
+      ok = InflateGzip(&input, &output);
+      break;
+    case JsonRecordReader::Zstd:
+#if defined(SIMPLE_JSON_WITH_ZSTD)
+      ok = DecompressZstd(&input, &output);
+#endif
+      break;
+    default:
+      ok = CopyPlain(&input, &output);
+  }
+  return ok && !input.failed();
+}
+
+// Cuts text fed in arbitrary pieces into top-level values by tracking
+// nesting and strings. A record that lies within one piece is handed over
+// in place; only records crossing pieces are gathered in `pending_`.
+class RecordFramer {
+ public:
+  explicit RecordFramer(bool unwrap_list)
+      : unwrap_list_(unwrap_list), base_(unwrap_list ? 1 : 0) {}
+
+  bool feed(string_view text, const JsonRecordReader::RecordCallback& emit) {
+    size_t begin = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+      if (in_string_) {
+        if (escaped_) {
+          escaped_ = false;
+          continue;
+        }
+        i += SkipPlainAscii(text.data() + i, text.data() + text.size());
+        if (i == text.size()) {
+          break;
+        }
+        if (text[i] == '\\') {
+          escaped_ = true;
+        } else if (text[i] == '"') {
+          in_string_ = false;
+          if (depth_ == base_ && !finishRecord(text, begin, i + 1, emit)) {
+            return false;
+          }
+        }
+        continue;
+      }
+
+      const char c = text[i];
+      if (in_record_) {
+        if (c == '"') {
+          in_string_ = true;
+          continue;
+        } else if (c == '{' || c == '[') {
+          ++depth_;
+          continue;
+        } else if ((c == '}' || c == ']') && depth_ > base_) {
+          if (--depth_ == base_ && !finishRecord(text, begin, i + 1, emit)) {
+            return false;
+          }
+          continue;
+        } else if (depth_ > base_ || !IsDelimiter(c)) {
+          continue;
+        }
+        // A number or literal ends right before its delimiter.
+        if (!finishRecord(text, begin, i, emit)) {
+          return false;
+        }
+      }
+
+      if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        continue;
+      }
+      if (unwrap_list_) {
+        if (list_state_ == BeforeList) {
+          if (c != '[') return false;
+          list_state_ = InList;
+          depth_ = 1;
+          continue;
+        }
+        if (list_state_ == AfterList) {
+          return false;
+        }
+        if (c == ',') {
+          continue;
+        }
+        if (c == ']') {
+          list_state_ = AfterList;
+          depth_ = 0;
+          continue;
+        }
+      }
+      if (c == ',' || c == '}' || c == ']') {
+        return false;
+      }
+      in_record_ = true;
+      begin = i;
+      if (c == '"') {
+        in_string_ = true;
+      } else if (c == '{' || c == '[') {
+        ++depth_;
+      }
+    }
+    if (in_record_) {
+      pending_.append(text.data() + begin, text.size() - begin);
+    }
+    return true;
+  }
+
+  // Takes the end of the input as the end of a pending number or literal.
+  bool finish(const JsonRecordReader::RecordCallback& emit) {
+    if (in_string_ || depth_ > base_ || list_state_ == InList) {
+      return false;
+    }
+    return !in_record_ || finishRecord(string_view(), 0, 0, emit);
+  }
+
+ private:
+  enum ListState { BeforeList, InList, AfterList };
+
+  static bool IsDelimiter(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ',' ||
+           c == '}' || c == ']';
+  }
+
+  bool finishRecord(string_view text, size_t begin, size_t end,
+                    const JsonRecordReader::RecordCallback& emit) {
+    in_record_ = false;
+    if (pending_.empty()) {
+      return emit(text.substr(begin, end - begin));
+    }
+    pending_.append(text.data(), end);
+    bool ok = emit(pending_);
+    pending_.clear();
+    return ok;
+  }
+
+  const bool unwrap_list_;
+  // Depth of the records themselves.
+  const size_t base_;
+  ListState list_state_ = BeforeList;
+  size_t depth_ = 0;
+  bool in_record_ = false;
+  bool in_string_ = false;
+  bool escaped_ = false;
+  string pending_;
+};
+
+}  // namespace
+
+bool JsonRecordReader::read(std::istream* input,
+                            const RecordCallback& on_record) const {
+  Options options = options_;
+  options.chunk_size = std::max<size_t>(options.chunk_size, 1);
+  options.queue_chunks = std::max<size_t>(options.queue_chunks, 1);
+
+  ChunkQueue queue(options.queue_chunks);
+  bool decompressed = false;
+  std::thread reader([&] {
+    decompressed = Decompress(input, options, &queue);
+    queue.close();
+  });
+
+  // Stops the reading thread on every way out, including a callback that
+  // throws; cancelling lets it out of a blocked push.
+  struct ReaderGuard {
+    ChunkQueue* queue;
+    std::thread* thread;
+    ~ReaderGuard() { stop(); }
+    void stop() {
+      if (thread->joinable()) {
+        queue->cancel();
+        thread->join();
+      }
+    }
+  } guard{&queue, &reader};
+
+  RecordFramer framer(options.unwrap_list);
+  string chunk;
+  bool ok = true;
+  while (ok && queue.pop(&chunk)) {
+    ok = framer.feed(chunk, on_record);
+    queue.recycle(&chunk);
+  }
+  guard.stop();
+  return ok && decompressed && framer.finish(on_record);
+}
+
+bool JsonRecordReader::readFile(const string& path,
+                                const RecordCallback& on_record) const {
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    return false;
+  }
+  return read(&input, on_record);
+}
+
+}  // namespace json
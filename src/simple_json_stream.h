@@ -0,0 +1,54 @@
+#ifndef SIMPLE_JSON_STREAM
+#define SIMPLE_JSON_STREAM
+
+#include <functional>
+#include <istream>
+#include <string>
+#include <string_view>
+
+namespace json {
+
+// Reads a stream of JSON records, i.e. whitespace or newline separated
+// values or the elements of one top-level list, from plain, gzip or zstd
+// compressed input. A background thread reads and decompresses the input
+// in fixed-size chunks into a bounded queue while the calling thread cuts
+// the text into records, so memory stays at a few chunks plus the longest
+// record whatever the size of the input.
+//
+// Records are only framed, not validated: each one is handed over as the
+// raw text of a single value, ready for Json, Validate or
+// JsonShredder::append. Zstd input needs a build with SIMPLE_JSON_WITH_ZSTD.
+class JsonRecordReader {
+ public:
+  enum Compression { Detect, None, Gzip, Zstd };
+
+  struct Options {
+    // Detect tells the formats apart by their magic numbers.
+    Compression compression = Detect;
+    size_t chunk_size = 1 << 16;
+    // Decompressed chunks that may wait for the parsing thread.
+    size_t queue_chunks = 4;
+    // Hands over the elements of a top-level list rather than the list.
+    bool unwrap_list = false;
+  };
+
+  // Returning false stops the reading.
+  using RecordCallback = std::function<bool(std::string_view record)>;
+
+  JsonRecordReader() = default;
+  explicit JsonRecordReader(const Options& options) : options_(options) {}
+
+  // Returns false when the input cannot be read or decompressed, ends in
+  // the middle of a record, or the callback stops early. Records before
+  // the failure have been handed over.
+  bool read(std::istream* input, const RecordCallback& on_record) const;
+
+  bool readFile(const std::string& path,
+                const RecordCallback& on_record) const;
+
+ private:
+  Options options_;
+};
+
+}  // namespace json
+#endif
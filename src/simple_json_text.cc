@@ -0,0 +1,37 @@
+#include "simple_json_text.h"
+
+#include <algorithm>
+
+namespace json {
+
+namespace {
+
+struct NullHandler {
+  void beginObject() {}
+  void endObject() {}
+  void beginList() {}
+  void endList() {}
+  void key(std::string_view) {}
+  void value(std::string_view) {}
+};
+
+}  // namespace
+
+ValidationResult Validate(std::string_view text) {
+  NullHandler handler;
+  JsonScanner<NullHandler> scanner(text, &handler);
+  ValidationResult result;
+  if (scanner.scan()) {
+    return result;
+  }
+  result.valid = false;
+  result.offset = scanner.errorOffset();
+  auto error_pos = text.begin() + result.offset;
+  result.line = std::count(text.begin(), error_pos, '\n') + 1;
+  auto line_start = std::find(std::make_reverse_iterator(error_pos),
+                              text.rend(), '\n');
+  result.column = std::distance(line_start.base(), error_pos) + 1;
+  return result;
+}
+
+}  // namespace json
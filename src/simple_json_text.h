@@ -0,0 +1,352 @@
+#ifndef SIMPLE_JSON_TEXT
+#define SIMPLE_JSON_TEXT
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "simple_json_utils.h"
+
+namespace json {
+
+// Single pass, non-allocating (beyond its nesting stack) scanner over JSON
+// text. It checks the text against RFC 8259, including that strings are
+// well-formed UTF-8, and reports the structure to a handler with the raw
+// text of every key and scalar:
+//
+//   void beginObject();  void endObject();
+//   void beginList();    void endList();
+//   void key(std::string_view raw);    // including the quotes
+//   void value(std::string_view raw);  // string, number or literal
+template <typename Handler>
+class JsonScanner {
+ public:
+  JsonScanner(std::string_view text, Handler* handler)
+      : text_(text), handler_(handler) {}
+
+  bool scan() {
+    State state = Value;
+    size_t pos = 0;
+    stack_.clear();
+    for (;;) {
+      pos = skipSpace(pos);
+      if (pos == text_.size()) {
+        break;
+      }
+      const char c = text_[pos];
+      switch (state) {
+        case ValueOrEnd:
+          if (c == ']') {
+            stack_.pop_back();
+            handler_->endList();
+            state = afterValue();
+            ++pos;
+            break;
+          }
+          [[fallthrough]];
+        case Value:
+          if (c == '{') {
+            stack_.push_back('{');
+            handler_->beginObject();
+            state = KeyOrEnd;
+            ++pos;
+          } else if (c == '[') {
+            stack_.push_back('[');
+            handler_->beginList();
+            state = ValueOrEnd;
+            ++pos;
+          } else {
+            size_t edge = scanScalar(pos);
+            if (edge == npos) {
+              return false;
+            }
+            handler_->value(text_.substr(pos, edge - pos));
+            state = afterValue();
+            pos = edge;
+          }
+          break;
+        case KeyOrEnd:
+          if (c == '}') {
+            stack_.pop_back();
+            handler_->endObject();
+            state = afterValue();
+            ++pos;
+            break;
+          }
+          [[fallthrough]];
+        case Key:
+          if (c == '"') {
+            size_t edge = scanString(pos);
+            if (edge == npos) {
+              return false;
+            }
+            handler_->key(text_.substr(pos, edge - pos));
+            state = Colon;
+            pos = edge;
+          } else {
+            return fail(pos);
+          }
+          break;
+        case Colon:
+          if (c != ':') {
+            return fail(pos);
+          }
+          state = Value;
+          ++pos;
+          break;
+        case CommaOrEnd:
+          if (c == ',') {
+            state = (stack_.back() == '{' ? Key : Value);
+          } else if (c == '}' && stack_.back() == '{') {
+            stack_.pop_back();
+            handler_->endObject();
+            state = afterValue();
+          } else if (c == ']' && stack_.back() == '[') {
+            stack_.pop_back();
+            handler_->endList();
+            state = afterValue();
+          } else {
+            return fail(pos);
+          }
+          ++pos;
+          break;
+        case Done:
+          return fail(pos);
+      }
+    }
+    return state == Done ? true : fail(pos);
+  }
+
+  // Offset of the first byte that could not be accepted.
+  size_t errorOffset() const { return error_offset_; }
+
+ private:
+  enum State { Value, ValueOrEnd, Key, KeyOrEnd, Colon, CommaOrEnd, Done };
+  static constexpr size_t npos = std::string_view::npos;
+
+  State afterValue() const { return stack_.empty() ? Done : CommaOrEnd; }
+
+  bool fail(size_t pos) {
+    error_offset_ = pos;
+    return false;
+  }
+
+  size_t reject(size_t pos) {
+    error_offset_ = pos;
+    return npos;
+  }
+
+  size_t skipSpace(size_t pos) const {
+    while (pos < text_.size() &&
+           (text_[pos] == ' ' || text_[pos] == '\n' || text_[pos] == '\r' ||
+            text_[pos] == '\t')) {
+      ++pos;
+    }
+    return pos;
+  }
+
+  size_t scanScalar(size_t pos) {
+    const char c = text_[pos];
+    if (c == '"') {
+      return scanString(pos);
+    } else if (c == '-' || ('0' <= c && c <= '9')) {
+      return scanNumber(pos);
+    } else if (c == 't') {
+      return scanLiteral(pos, "true");
+    } else if (c == 'f') {
+      return scanLiteral(pos, "false");
+    } else if (c == 'n') {
+      return scanLiteral(pos, "null");
+    }
+    return reject(pos);
+  }
+
+  size_t scanLiteral(size_t pos, std::string_view literal) {
+    if (text_.substr(pos, literal.size()) == literal) {
+      return pos + literal.size();
+    }
+    return reject(pos);
+  }
+
+  static bool IsDigit(char c) { return '0' <= c && c <= '9'; }
+
+  static bool IsHex(char c) {
+    return IsDigit(c) || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F');
+  }
+
+  size_t scanDigits(size_t pos) {
+    size_t start = pos;
+    while (pos < text_.size() && IsDigit(text_[pos])) ++pos;
+    return pos == start ? reject(pos) : pos;
+  }
+
+  size_t scanNumber(size_t pos) {
+    if (text_[pos] == '-') ++pos;
+    if (pos < text_.size() && text_[pos] == '0') {
+      ++pos;
+    } else if ((pos = scanDigits(pos)) == npos) {
+      return npos;
+    }
+    if (pos < text_.size() && text_[pos] == '.') {
+      if ((pos = scanDigits(pos + 1)) == npos) return npos;
+    }
+    if (pos < text_.size() && (text_[pos] == 'e' || text_[pos] == 'E')) {
+      ++pos;
+      if (pos < text_.size() && (text_[pos] == '+' || text_[pos] == '-')) {
+        ++pos;
+      }
+      if ((pos = scanDigits(pos)) == npos) return npos;
+    }
+    return pos;
+  }
+
+  // Returns the position just past the closing quote. Escapes are checked
+  // by DecodeJsonEscape, so the scanner and the parser accept the same ones.
+  size_t scanString(size_t pos) {
+    const char* finish = text_.data() + text_.size();
+    for (++pos; pos < text_.size();) {
+      const char* p_cur = text_.data() + pos;
+      p_cur += SkipPlainAscii(p_cur, finish);
+      pos = p_cur - text_.data();
+      if (pos == text_.size()) break;
+      const unsigned char c = *p_cur;
+      if (c == '"') {
+        return pos + 1;
+      } else if (c == '\\') {
+        const char* next = DecodeJsonEscape(p_cur, finish, nullptr);
+        if (next == nullptr) {
+          return reject(escapeError(pos));
+        }
+        pos = next - text_.data();
+      } else if (c < 0x20) {
+        return reject(pos);
+      } else {
+        size_t length = Utf8SequenceLength(p_cur, finish);
+        if (length == 0) {
+          return reject(pos);
+        }
+        pos += length;
+      }
+    }
+    return reject(text_.size());
+  }
+
+  // Points at the byte that makes the escape at `pos` malformed, or at the
+  // escape itself for a surrogate without its pair.
+  size_t escapeError(size_t pos) const {
+    if (pos + 1 == text_.size() || text_[pos + 1] != 'u') {
+      return pos + 1;
+    }
+    for (size_t i = 2; i < 6; ++i) {
+      if (pos + i == text_.size() || !IsHex(text_[pos + i])) return pos + i;
+    }
+    return pos;
+  }
+
+  std::string_view text_;
+  Handler* handler_;
+  std::vector<char> stack_;
+  size_t error_offset_ = 0;
+};
+
+// Location of the first error found by Validate. Lines and columns count
+// from 1, columns in bytes.
+struct ValidationResult {
+  bool valid = true;
+  size_t offset = 0;
+  size_t line = 0;
+  size_t column = 0;
+
+  explicit operator bool() const { return valid; }
+};
+
+// Checks that `text` is well-formed JSON without building any nodes.
+ValidationResult Validate(std::string_view text);
+
+// Re-emits scanned JSON text. `indent` < 0 writes the most compact form,
+// otherwise every member and element is put on its own line.
+template <typename Sink>
+class JsonReformatter {
+ public:
+  JsonReformatter(Sink* sink, int indent) : sink_(sink), indent_(indent) {}
+
+  void beginObject() { open('{'); }
+  void endObject() { close('}'); }
+  void beginList() { open('['); }
+  void endList() { close(']'); }
+
+  void key(std::string_view raw) {
+    separate();
+    sink_->append(raw.data(), raw.size());
+    sink_->push_back(':');
+    if (indent_ >= 0) sink_->push_back(' ');
+    after_key_ = true;
+  }
+
+  void value(std::string_view raw) {
+    separate();
+    sink_->append(raw.data(), raw.size());
+  }
+
+ private:
+  void separate() {
+    if (after_key_) {
+      after_key_ = false;
+      return;
+    }
+    if (first_.empty()) {
+      return;
+    }
+    if (first_.back()) {
+      first_.back() = false;
+    } else {
+      sink_->push_back(',');
+    }
+    newline(first_.size());
+  }
+
+  void open(char bracket) {
+    separate();
+    sink_->push_back(bracket);
+    first_.push_back(true);
+  }
+
+  void close(char bracket) {
+    bool empty = first_.back();
+    first_.pop_back();
+    if (!empty) newline(first_.size());
+    sink_->push_back(bracket);
+  }
+
+  void newline(size_t depth) {
+    if (indent_ < 0) return;
+    sink_->push_back('\n');
+    for (size_t i = 0; i < depth * indent_; ++i) sink_->push_back(' ');
+  }
+
+  Sink* sink_;
+  int indent_;
+  // Whether nothing has been written yet in each open container.
+  std::vector<bool> first_;
+  bool after_key_ = false;
+};
+
+// Sinks are anything with `append(const char*, size_t)` and `push_back(char)`,
+// e.g. std::string. Keys keep their order and numbers and strings are copied
+// verbatim. Returns false on malformed input, after which the sink holds a
+// partial output.
+template <typename Sink>
+bool Minify(std::string_view text, Sink* sink) {
+  JsonReformatter<Sink> reformatter(sink, -1);
+  return JsonScanner<JsonReformatter<Sink>>(text, &reformatter).scan();
+}
+
+template <typename Sink>
+bool Prettify(std::string_view text, int indent, Sink* sink) {
+  JsonReformatter<Sink> reformatter(sink, indent < 0 ? 0 : indent);
+  return JsonScanner<JsonReformatter<Sink>>(text, &reformatter).scan();
+}
+
+}  // namespace json
+#endif
@@ -1,8 +1,12 @@
 #include "simple_json_utils.h"
 
-#include <iomanip>
+#include <charconv>
 #include <sstream>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace json {
 
 using std::string;
@@ -45,40 +49,10 @@ const std::regex ObjListPat({"\\["
 const std::regex ObjItemPat({"(" _OBJ_PAT ")"}, DefaultRegOpt);
 
 auto EscapeJson(const string& raw_str) -> string {
-  std::ostringstream oss;
-  for (auto c = raw_str.begin(); c != raw_str.end(); ++c) {
-    switch (*c) {
-      case '\\':
-        oss << "\\\\";
-        break;
-      case '\b':
-        oss << "\\b";
-        break;
-      case '\f':
-        oss << "\\f";
-        break;
-      case '\n':
-        oss << "\\n";
-        break;
-      case '\r':
-        oss << "\\r";
-        break;
-      case '"':
-        oss << "\\\"";
-        break;
-      case '\t':
-        oss << "\\t";
-        break;
-      default:
-        if ('\x00' <= *c && *c <= '\x1f') {
-          oss << "\\u" << std::hex << std::setw(4) << std::setfill('0')
-              << static_cast<int>(*c);
-        } else {
-          oss << *c;
-        }
-    }
-  }
-  return oss.str();
+  string builder;
+  builder.reserve(raw_str.size());
+  AppendEscapedJson(raw_str, &builder);
+  return builder;
 }
 
 int str2int(const string& str) {
@@ -110,4 +84,233 @@ int str2int(const string& str) {
   }
 }
 
+bool ParseInt64(std::string_view token, int64_t* value) {
+  bool negative = !token.empty() && token[0] == '-';
+  if (!token.empty() && (token[0] == '-' || token[0] == '+')) {
+    token.remove_prefix(1);
+  }
+  int base = 10;
+  if (token.size() > 1 && token[0] == '0') {
+    char prefix = std::tolower(token[1]);
+    base = prefix == 'x' ? 16 : prefix == 'b' ? 2 : 8;
+    token.remove_prefix(base == 8 ? 1 : 2);
+  }
+  // Like str2int, an octal number ends at its first non-octal digit.
+  uint64_t magnitude = 0;
+  if (std::from_chars(token.data(), token.data() + token.size(), magnitude,
+                      base)
+          .ec != std::errc()) {
+    return false;
+  }
+  const uint64_t limit = uint64_t(INT64_MAX) + (negative ? 1 : 0);
+  if (magnitude > limit) {
+    return false;
+  }
+  *value = negative ? int64_t(0 - magnitude) : int64_t(magnitude);
+  return true;
+}
+
+size_t SkipPlainAscii(const char* start, const char* finish) {
+  const char* p_cur = start;
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i slash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  while (finish - p_cur >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p_cur));
+    // Non-ASCII bytes already carry the high bit the mask is built from;
+    // bytes up to 0x1f are the ones left unchanged by an unsigned max.
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(chunk,
+                     _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, slash)));
+    if (int mask = _mm_movemask_epi8(special)) {
+      return (p_cur - start) + __builtin_ctz(mask);
+    }
+    p_cur += 16;
+  }
+#endif
+  while (p_cur < finish && *p_cur != '"' && *p_cur != '\\' &&
+         static_cast<unsigned char>(*p_cur) >= 0x20 &&
+         static_cast<unsigned char>(*p_cur) < 0x80) {
+    ++p_cur;
+  }
+  return p_cur - start;
+}
+
+size_t SkipUnescaped(const char* start, const char* finish) {
+  const char* p_cur = start;
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i slash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  while (finish - p_cur >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p_cur));
+    // Bytes up to 0x1f are the ones left unchanged by an unsigned max.
+    __m128i special = _mm_or_si128(
+        _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, slash)));
+    if (int mask = _mm_movemask_epi8(special)) {
+      return (p_cur - start) + __builtin_ctz(mask);
+    }
+    p_cur += 16;
+  }
+#endif
+  while (p_cur < finish && *p_cur != '"' && *p_cur != '\\' &&
+         static_cast<unsigned char>(*p_cur) >= 0x20) {
+    ++p_cur;
+  }
+  return p_cur - start;
+}
+
+size_t Utf8SequenceLength(const char* start, const char* finish) {
+  auto byte = [start](size_t i) { return static_cast<unsigned char>(start[i]); };
+  const unsigned char lead = byte(0);
+  if (lead < 0x80) {
+    return 1;
+  }
+  size_t length = 0;
+  unsigned char low = 0x80, high = 0xbf;
+  if (0xc2 <= lead && lead <= 0xdf) {
+    length = 2;
+  } else if (0xe0 <= lead && lead <= 0xef) {
+    length = 3;
+    if (lead == 0xe0) low = 0xa0;  // overlong
+    if (lead == 0xed) high = 0x9f;  // surrogates
+  } else if (0xf0 <= lead && lead <= 0xf4) {
+    length = 4;
+    if (lead == 0xf0) low = 0x90;  // overlong
+    if (lead == 0xf4) high = 0x8f;  // beyond U+10FFFF
+  } else {
+    return 0;
+  }
+  if (finish - start < static_cast<std::ptrdiff_t>(length)) {
+    return 0;
+  }
+  if (byte(1) < low || byte(1) > high) {
+    return 0;
+  }
+  for (size_t i = 2; i < length; ++i) {
+    if ((byte(i) & 0xc0) != 0x80) return 0;
+  }
+  return length;
+}
+
+void AppendUtf8(uint32_t code_point, string* builder) {
+  if (code_point < 0x80) {
+    builder->push_back(static_cast<char>(code_point));
+  } else if (code_point < 0x800) {
+    builder->push_back(static_cast<char>(0xc0 | (code_point >> 6)));
+    builder->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+  } else if (code_point < 0x10000) {
+    builder->push_back(static_cast<char>(0xe0 | (code_point >> 12)));
+    builder->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+    builder->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+  } else {
+    builder->push_back(static_cast<char>(0xf0 | (code_point >> 18)));
+    builder->push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3f)));
+    builder->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+    builder->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+  }
+}
+
+namespace {
+
+int HexValue(char ch) {
+  if ('0' <= ch && ch <= '9') return ch - '0';
+  if ('a' <= ch && ch <= 'f') return ch - 'a' + 10;
+  if ('A' <= ch && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
+
+// Reads the four hex digits after "\u" at `start`.
+bool ParseHex4(const char* start, const char* finish, uint32_t* code_unit) {
+  if (finish - start < 6) {
+    return false;
+  }
+  *code_unit = 0;
+  for (int i = 2; i < 6; ++i) {
+    int digit = HexValue(start[i]);
+    if (digit < 0) return false;
+    *code_unit = (*code_unit << 4) | digit;
+  }
+  return true;
+}
+
+}  // namespace
+
+const char* DecodeJsonEscape(const char* start, const char* finish,
+                             string* builder) {
+  if (finish - start < 2) {
+    return nullptr;
+  }
+  char decoded;
+  switch (start[1]) {
+    case '"':
+    case '\\':
+    case '/':
+      decoded = start[1];
+      break;
+    case 'b':
+      decoded = '\b';
+      break;
+    case 'f':
+      decoded = '\f';
+      break;
+    case 'n':
+      decoded = '\n';
+      break;
+    case 'r':
+      decoded = '\r';
+      break;
+    case 't':
+      decoded = '\t';
+      break;
+    case 'u': {
+      uint32_t code_point = 0;
+      if (!ParseHex4(start, finish, &code_point)) {
+        return nullptr;
+      }
+      start += 6;
+      if (0xdc00 <= code_point && code_point <= 0xdfff) {
+        return nullptr;
+      }
+      if (0xd800 <= code_point && code_point <= 0xdbff) {
+        uint32_t low = 0;
+        if (finish - start < 2 || start[0] != '\\' || start[1] != 'u' ||
+            !ParseHex4(start, finish, &low) || low < 0xdc00 ||
+            low > 0xdfff) {
+          return nullptr;
+        }
+        code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+        start += 6;
+      }
+      if (builder != nullptr) AppendUtf8(code_point, builder);
+      return start;
+    }
+    default:
+      return nullptr;
+  }
+  if (builder != nullptr) builder->push_back(decoded);
+  return start + 2;
+}
+
+bool UnescapeJson(std::string_view body, string* builder) {
+  const char* p_cur = body.data();
+  const char* finish = body.data() + body.size();
+  builder->clear();
+  while (p_cur < finish) {
+    const char* run = p_cur;
+    while (p_cur < finish && *p_cur != '\\') ++p_cur;
+    builder->append(run, p_cur);
+    if (p_cur < finish &&
+        (p_cur = DecodeJsonEscape(p_cur, finish, builder)) == nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+
 }  // namespace json
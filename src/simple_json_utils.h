@@ -1,7 +1,9 @@
 #ifndef SIMPLE_JSON_UTILS
 #define SIMPLE_JSON_UTILS
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <regex>
 
@@ -19,6 +21,55 @@ extern const std::regex ObjItemPat;
 
 auto EscapeJson(const std::string& raw_str) -> std::string;
 
+// Counts the leading bytes of [start, finish) that can go into a string
+// literal as they are, i.e. anything but a quote, a backslash or a control
+// character, 16 bytes at a time where SSE2 is available.
+size_t SkipUnescaped(const char* start, const char* finish);
+
+// Appends `raw` escaped for a string literal, copying unescaped runs whole.
+// Sinks are anything with `append(const char*, size_t)` and `push_back(char)`.
+template <typename Sink>
+void AppendEscapedJson(std::string_view raw, Sink* sink) {
+  static const char kHex[] = "0123456789abcdef";
+  const char* p_cur = raw.data();
+  const char* finish = p_cur + raw.size();
+  while (p_cur < finish) {
+    size_t plain = SkipUnescaped(p_cur, finish);
+    sink->append(p_cur, plain);
+    p_cur += plain;
+    if (p_cur == finish) {
+      break;
+    }
+    const char c = *p_cur++;
+    sink->push_back('\\');
+    switch (c) {
+      case '"':
+      case '\\':
+        sink->push_back(c);
+        break;
+      case '\b':
+        sink->push_back('b');
+        break;
+      case '\f':
+        sink->push_back('f');
+        break;
+      case '\n':
+        sink->push_back('n');
+        break;
+      case '\r':
+        sink->push_back('r');
+        break;
+      case '\t':
+        sink->push_back('t');
+        break;
+      default:
+        sink->append("u00", 3);
+        sink->push_back(kHex[(c >> 4) & 0xf]);
+        sink->push_back(kHex[c & 0xf]);
+    }
+  }
+}
+
 template <typename StringT = std::string>
 auto SplitString(const StringT& content, char sep) -> std::vector<StringT> {
   // return: start_pos, finish_pos
@@ -56,5 +107,30 @@ auto SplitString(const StringT& content, char sep) -> std::vector<StringT> {
 
 int str2int(const std::string& str); 
 
+// Parses an integer in the IntPat language (decimal, 0 octal, 0x hex, 0b
+// binary, with an optional sign). Returns false when it does not fit in an
+// int64_t.
+bool ParseInt64(std::string_view token, int64_t* value);
+
+// Counts the leading bytes of [start, finish) that are printable ASCII and
+// neither a quote nor a backslash, 16 bytes at a time where SSE2 is
+// available.
+size_t SkipPlainAscii(const char* start, const char* finish);
+
+// Length of the well-formed UTF-8 sequence at `start`, or 0 when it is
+// truncated, overlong, a surrogate or beyond U+10FFFF.
+size_t Utf8SequenceLength(const char* start, const char* finish);
+
+void AppendUtf8(uint32_t code_point, std::string* builder);
+
+// Decodes the escape sequence starting at the backslash `start` into
+// `builder`, joining \u surrogate pairs; with a null `builder` it is only
+// checked. Returns the position after it, or nullptr when it is malformed.
+const char* DecodeJsonEscape(const char* start, const char* finish,
+                             std::string* builder);
+
+// Decodes the body of a string literal, without its quotes.
+bool UnescapeJson(std::string_view body, std::string* builder);
+
 }
 #endif
@@ -0,0 +1,142 @@
+#ifndef SIMPLE_JSON_WRITER
+#define SIMPLE_JSON_WRITER
+
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "simple_json_utils.h"
+
+namespace json {
+
+// Emits compact JSON text straight into a sink, for output that never
+// needs a tree. Sinks are anything with `append(const char*, size_t)` and
+// `push_back(char)`, e.g. std::string. Commas and quotes are placed by the
+// writer; debug builds assert that calls nest properly, e.g. that every
+// object member starts with key(). Non-finite floats are written as null.
+//
+//   JsonWriter<std::string> writer(&out);
+//   writer.beginObject();
+//   writer.key("ids");
+//   writer.beginList();
+//   writer.value(1);
+//   writer.endList();
+//   writer.endObject();
+template <typename Sink>
+class JsonWriter {
+ public:
+  explicit JsonWriter(Sink* sink) : sink_(sink) {}
+
+  // Starts a new document on `sink`, keeping the nesting stack's storage.
+  void reset(Sink* sink) {
+    sink_ = sink;
+    stack_.clear();
+    first_ = true;
+    after_key_ = false;
+  }
+
+  void beginObject() { open('{'); }
+  void endObject() { close('{', '}'); }
+  void beginList() { open('['); }
+  void endList() { close('[', ']'); }
+
+  void key(std::string_view name) {
+    assert(!stack_.empty() && stack_.back() == '{' && !after_key_);
+    if (!first_) sink_->push_back(',');
+    first_ = false;
+    sink_->push_back('"');
+    AppendEscapedJson(name, sink_);
+    sink_->append("\":", 2);
+    after_key_ = true;
+  }
+
+  template <typename T, typename = std::enable_if_t<std::is_integral_v<T> &&
+                                                    !std::is_same_v<T, bool>>>
+  void value(T number) {
+    separate();
+    char buffer[24];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), number);
+    sink_->append(buffer, result.ptr - buffer);
+  }
+
+  void value(double number) {
+    separate();
+    if (!std::isfinite(number)) {
+      sink_->append("null", 4);
+      return;
+    }
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), number);
+    sink_->append(buffer, result.ptr - buffer);
+  }
+
+  void value(bool flag) {
+    separate();
+    if (flag) {
+      sink_->append("true", 4);
+    } else {
+      sink_->append("false", 5);
+    }
+  }
+
+  void value(std::string_view text) {
+    separate();
+    sink_->push_back('"');
+    AppendEscapedJson(text, sink_);
+    sink_->push_back('"');
+  }
+
+  // Without it string literals would convert to bool.
+  void value(const char* text) { value(std::string_view(text)); }
+
+  void value(std::nullptr_t) {
+    separate();
+    sink_->append("null", 4);
+  }
+
+  // Whether exactly one complete top-level value has been written.
+  bool done() const { return stack_.empty() && !first_; }
+
+ private:
+  // Puts the comma before a value, unless it follows its key.
+  void separate() {
+    if (after_key_) {
+      after_key_ = false;
+      return;
+    }
+    assert(stack_.empty() ? first_ : stack_.back() == '[');
+    if (!first_) sink_->push_back(',');
+    first_ = false;
+  }
+
+  void open(char bracket) {
+    separate();
+    sink_->push_back(bracket);
+    stack_.push_back(bracket);
+    first_ = true;
+  }
+
+  void close(char open_bracket, char bracket) {
+    assert(!stack_.empty() && stack_.back() == open_bracket && !after_key_);
+    (void)open_bracket;
+    stack_.pop_back();
+    sink_->push_back(bracket);
+    // The enclosing container now holds at least this one.
+    first_ = false;
+  }
+
+  Sink* sink_;
+  std::vector<char> stack_;
+  // Whether nothing has been written yet in the innermost open container,
+  // or at the top level.
+  bool first_ = true;
+  bool after_key_ = false;
+};
+
+}  // namespace json
+#endif
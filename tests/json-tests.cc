@@ -1,6 +1,17 @@
 #include <gtest/gtest.h>
+#include <zlib.h>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 #include "simple_json.hpp"
+#include "simple_json_columns.h"
+#include "simple_json_parallel.h"
+#include "simple_json_patch.h"
+#include "simple_json_stream.h"
+#include "simple_json_text.h"
+#include "simple_json_writer.h"
 
 TEST(SimpleJson, Parse) {
   using namespace std;
@@ -59,6 +70,8 @@ TEST(SimpleJson, Parse) {
     R"({"34^": [})",
     R"({"34": 34, }})",
     R"({"34": 34,})",
+    R"({"a": 1, "a": tru})",
+    R"({"a": 1, "a": {"b" 2}})",
   };
 
   for (const auto& invlaid_json: invalid_json_list) {
@@ -93,3 +106,924 @@ TEST(SimpleJson, Generater) {
       R"({"name": "generator", "numbers": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 450], "z\\skip\\": "\"value\""})";
   EXPECT_STREQ(vec_json.str().data(), gen_str);
 }
+
+TEST(SimpleJson, Patch) {
+  using namespace std;
+  using namespace json;
+
+  Json json(R"({"name": "patch", "inner": {"ints": [1, 2, 3], "flag": true},
+                "drop": 1})");
+  EXPECT_TRUE(json.valid());
+
+  auto make_op = [](string op, string path) {
+    JsonNode node;
+    node.insert("op", JsonNode(op));
+    node.insert("path", JsonNode(path));
+    return node;
+  };
+
+  JsonNode patch = vector<JsonNode>();
+  {
+    auto op = make_op("add", "/inner/ints/1");
+    op.insert("value", JsonNode(10));
+    patch.push(move(op));
+  }
+  {
+    auto op = make_op("add", "/inner/ints/-");
+    op.insert("value", JsonNode(20));
+    patch.push(move(op));
+  }
+  patch.push(make_op("remove", "/drop"));
+  {
+    auto op = make_op("replace", "/name");
+    op.insert("value", JsonNode("patched"));
+    patch.push(move(op));
+  }
+  {
+    auto op = make_op("move", "/moved~1flag");
+    op.insert("from", JsonNode("/inner/flag"));
+    patch.push(move(op));
+  }
+  {
+    auto op = make_op("copy", "/copy");
+    op.insert("from", JsonNode("/inner/ints"));
+    patch.push(move(op));
+  }
+  {
+    auto op = make_op("test", "/copy/4");
+    op.insert("value", JsonNode(20));
+    patch.push(move(op));
+  }
+
+  EXPECT_TRUE(JsonPatch::Apply(json.root().value(), move(patch)));
+  EXPECT_STREQ(
+      json.str().data(),
+      R"({"copy": [1, 10, 2, 3, 20], "inner": {"ints": [1, 10, 2, 3, 20]}, "moved/flag": true, "name": "patched"})");
+
+  JsonNode failed = vector<JsonNode>();
+  {
+    auto op = make_op("test", "/name");
+    op.insert("value", JsonNode("other"));
+    failed.push(move(op));
+  }
+  EXPECT_FALSE(JsonPatch::Apply(json.root().value(), move(failed)));
+
+  // Numbers test equal by value, also inside lists and objects.
+  Json numbers(R"({"n": 1, "list": [1, 2.5], "obj": {"f": 2.0}})");
+  for (auto [path, value, equal] :
+       {make_tuple("/n", JsonNode(1.0), true),
+        make_tuple("/n", JsonNode(1.5), false),
+        make_tuple("/list", JsonNode(vector<double>{1.0, 2.5}), true),
+        make_tuple("/obj/f", JsonNode(2), true),
+        make_tuple("/n", JsonNode(true), false)}) {
+    JsonNode test = vector<JsonNode>();
+    auto op = make_op("test", path);
+    op.insert("value", JsonNode(value));
+    test.push(move(op));
+    EXPECT_EQ(JsonPatch::Apply(numbers.root().value(), move(test)), equal)
+        << path;
+  }
+
+  JsonNode bad_path = vector<JsonNode>();
+  bad_path.push(make_op("remove", "/inner/ints/01"));
+  EXPECT_FALSE(JsonPatch::Apply(json.root().value(), move(bad_path)));
+
+  JsonNode overflow = vector<JsonNode>();
+  {
+    auto op = make_op("add", "/inner/ints/18446744073709551616");
+    op.insert("value", JsonNode(9));
+    overflow.push(move(op));
+  }
+  EXPECT_FALSE(JsonPatch::Apply(json.root().value(), move(overflow)));
+  EXPECT_EQ(json["inner"]["ints"]->str(), "[1, 10, 2, 3, 20]");
+
+  // A packed list is a list, but not of operations.
+  Json packed_patch("[1, 2]");
+  EXPECT_FALSE(JsonPatch::Apply(json.root().value(),
+                                packed_patch.root()->clone()));
+
+  Json merge(R"({"title": "Goodbye!", "author": {"given": "John",
+                 "family": "Doe"}, "ids": [1, 2],
+                 "content": "text"})");
+  EXPECT_TRUE(merge.valid());
+  Json merge_patch(R"({"title": "Hello!", "phone": "+01-123-456-7890",
+                       "author": {"family": null}, "ids": [3]})");
+  EXPECT_TRUE(merge_patch.valid());
+  EXPECT_TRUE(
+      JsonPatch::MergeApply(merge.root().value(), merge_patch.root()->clone()));
+  EXPECT_STREQ(
+      merge.str().data(),
+      R"({"author": {"given": "John"}, "content": "text", "ids": [3], "phone": "+01-123-456-7890", "title": "Hello!"})");
+}
+
+TEST(SimpleJson, Projection) {
+  using namespace std;
+  using namespace json;
+
+  string record = R"({"id": 7, "name": "skipped \" name",
+                      "user": {"id": 3, "tags": [1, 2], "meta": {"a": 1}},
+                      "blob": {"deep": [[1], [2]]}, "score": 1.5})";
+
+  Json projected(record, JsonProjection{"id", "user.id", "user.meta"});
+  EXPECT_TRUE(projected.valid());
+  EXPECT_STREQ(projected.str().data(),
+               R"({"id": 7, "user": {"id": 3, "meta": {"a": 1}}})");
+
+  Json by_predicate(record, JsonProjection([](string_view path) {
+                      return path == "score" || path == "user" ||
+                             path == "user.tags";
+                    }));
+  EXPECT_TRUE(by_predicate.valid());
+  EXPECT_STREQ(by_predicate.str().data(),
+               R"({"score": 1.500000, "user": {"tags": [1, 2]}})");
+
+  Json nothing(record, JsonProjection{"missing"});
+  EXPECT_TRUE(nothing.valid());
+  EXPECT_STREQ(nothing.str().data(), "{}");
+
+  Json broken(R"({"id": 7, "blob": [1, 2})", JsonProjection{"id"});
+  EXPECT_FALSE(broken.valid());
+  // Skipped members are still checked.
+  for (const char* text : {R"({"id": 7, "blob": [1 2]})",
+                           R"({"id": 7, "blob": {"a": nul}})",
+                           R"({"id": 7, "blob": {1: 2}})",
+                           R"({"id": 7, "blob": ["\q"]})",
+                           R"({"id": 7, "blob": {"\ud800": 1}})",
+                           "{\"id\": 7, \"blob\": [\"a\tb\"]}",
+                           "{\"id\": 7, \"blob\": [\"\xc0\xaf\"]}"}) {
+    EXPECT_FALSE(Json(text, JsonProjection{"id"}).valid()) << text;
+  }
+  EXPECT_TRUE(Json(R"({"id": 7, "blob": [0x1F, {"a": [null, +.5]}]})",
+                   JsonProjection{"id"})
+                  .valid());
+  EXPECT_TRUE(Json(R"({"blob": {"k\"\u00e9": "\ud83d\ude00 café \/"},
+                       "id": 7})",
+                   JsonProjection{"id"})
+                  .valid());
+}
+
+TEST(SimpleJson, Reformat) {
+  using namespace std;
+  using namespace json;
+
+  string text = R"( {"z": [1, 2.50, -3e+2, {}],
+                     "a": {"s": "x\"\u00e9", "n": null, "e": []},
+                     "b": true } )";
+
+  string minified;
+  EXPECT_TRUE(Minify(text, &minified));
+  EXPECT_STREQ(
+      minified.data(),
+      R"({"z":[1,2.50,-3e+2,{}],"a":{"s":"x\"\u00e9","n":null,"e":[]},"b":true})");
+
+  string pretty;
+  EXPECT_TRUE(Prettify(minified, 2, &pretty));
+  EXPECT_STREQ(pretty.data(),
+               "{\n"
+               "  \"z\": [\n"
+               "    1,\n"
+               "    2.50,\n"
+               "    -3e+2,\n"
+               "    {}\n"
+               "  ],\n"
+               "  \"a\": {\n"
+               "    \"s\": \"x\\\"\\u00e9\",\n"
+               "    \"n\": null,\n"
+               "    \"e\": []\n"
+               "  },\n"
+               "  \"b\": true\n"
+               "}");
+
+  string scalar;
+  EXPECT_TRUE(Minify(" 42 ", &scalar));
+  EXPECT_STREQ(scalar.data(), "42");
+
+  vector<string> invalid_list = {
+      "",        "{",          R"({"a" 1})", R"({"a": 1,})", "[1 2]",
+      "[01]",    "[1.]",       "[tru]",      R"(["\x"])",   "{} {}",
+      R"({a: 1})", R"(["a)", "]",
+  };
+  for (const auto& invalid : invalid_list) {
+    string sink;
+    EXPECT_FALSE(Minify(invalid, &sink)) << invalid;
+  }
+}
+
+TEST(SimpleJson, Validate) {
+  using namespace std;
+  using namespace json;
+
+  EXPECT_TRUE(Validate(R"({"a": [1, 2, {"b": "a long plain string value"}]})"));
+
+  auto result = Validate("{\n  \"a\": [1, 2,],\n  \"b\": 3\n}");
+  EXPECT_FALSE(result);
+  EXPECT_EQ(result.offset, size_t(15));
+  EXPECT_EQ(result.line, size_t(2));
+  EXPECT_EQ(result.column, size_t(14));
+
+  result = Validate("[\"0123456789abcdef\x01\"]");
+  EXPECT_FALSE(result);
+  EXPECT_EQ(result.offset, size_t(18));
+
+  result = Validate(R"(["\u12g4"])");
+  EXPECT_FALSE(result);
+  EXPECT_EQ(result.offset, size_t(6));
+
+  result = Validate("{\"a\": 1");
+  EXPECT_FALSE(result);
+  EXPECT_EQ(result.offset, size_t(7));
+  EXPECT_EQ(result.column, size_t(8));
+}
+
+TEST(SimpleJson, ParallelWriter) {
+  using namespace std;
+  using namespace json;
+
+  JsonNode root;
+  root.insert("name", JsonNode("export"));
+  vector<JsonNode> rows;
+  for (int i = 0; i < 1000; ++i) {
+    JsonNode row;
+    row.insert("id", JsonNode(i));
+    row.insert("value", JsonNode(i * 0.5));
+    row.insert("tag", JsonNode(i % 2 == 0 ? "even\n" : "odd"));
+    rows.push_back(move(row));
+  }
+  root.insert("rows", move(rows));
+  JsonNode wide;
+  for (int i = 0; i < 100; ++i) {
+    wide.insert("k" + to_string(i), JsonNode(i % 3 == 0));
+  }
+  root.insert("wide", move(wide));
+  root.insert("samples", JsonNode::IntListType(500, -7));
+  root.insert("ratios", JsonNode::FloatListType(300, 0.25));
+  root.insert("flags", JsonNode::BoolListType(200, true));
+
+  string serial = root.str();
+  for (size_t threads : {1, 2, 3, 8}) {
+    JsonParallelWriter writer(threads);
+    EXPECT_EQ(writer.str(root), serial);
+    string joined;
+    for (const auto& piece : writer.chunks(root)) {
+      joined.append(piece);
+    }
+    EXPECT_EQ(joined, serial);
+  }
+  EXPECT_EQ(JsonParallelWriter().str(JsonNode(3)), "3");
+
+  // Packed lists are cut into chunks like lists of nodes.
+  JsonNode samples = JsonNode::IntListType{1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  auto pieces = JsonParallelWriter(4).chunks(samples);
+  EXPECT_GT(pieces.size(), 3);
+  string joined;
+  for (const auto& piece : pieces) joined.append(piece);
+  EXPECT_EQ(joined, samples.str());
+}
+
+TEST(SimpleJson, PackedList) {
+  using namespace std;
+  using namespace json;
+
+  Json json(R"({"ints": [1, -2, 0x10], "doubles": [0.5, -1.25],
+                "bools": [true, false, true]})");
+  EXPECT_TRUE(json.valid());
+
+  auto ints = json["ints"];
+  EXPECT_TRUE(ints->isType(JsonNode::IntList));
+  EXPECT_TRUE(ints->isList());
+  auto int_span = ints->asIntSpan();
+  EXPECT_EQ(vector<int64_t>(int_span.begin(), int_span.end()),
+            vector<int64_t>({1, -2, 16}));
+  EXPECT_TRUE(ints->asDoubleSpan().empty());
+
+  auto doubles = json["doubles"]->asDoubleSpan();
+  EXPECT_EQ(int(doubles.size()), 2);
+  EXPECT_DOUBLE_EQ(doubles[1], -1.25);
+  EXPECT_EQ(json["bools"]->asBoolBits(), vector<bool>({true, false, true}));
+
+  EXPECT_STREQ(
+      json.str().data(),
+      R"({"bools": [true, false, true], "doubles": [0.500000, -1.250000], "ints": [1, -2, 16]})");
+
+  // Const element access leaves the packed storage in place.
+  const JsonNode& packed = *ints.value();
+  EXPECT_EQ(packed.at(2)->toInt(), 16);
+  auto nodes = packed.toList();
+  EXPECT_EQ(int(nodes.size()), 3);
+  EXPECT_EQ(nodes[1]->toInt(), -2);
+  EXPECT_EQ(nodes[2], packed.at(2).value());
+  EXPECT_TRUE(packed.isType(JsonNode::IntList));
+  EXPECT_EQ(packed.asIntSpan().data(), int_span.data());
+  EXPECT_FALSE(json.root().at("bools").at(size_t(0))->isList());
+  EXPECT_TRUE(json["bools"]->isType(JsonNode::BoolList));
+
+  json["ints"]->push(JsonNode(4));
+  EXPECT_EQ(int(json["ints"]->asIntSpan().size()), 4);
+
+  JsonNode expected = vector<JsonNode>{JsonNode(1), JsonNode(-2), JsonNode(16),
+                                       JsonNode(4)};
+  EXPECT_TRUE(*json["ints"].value() == expected);
+  EXPECT_TRUE(expected == *json["ints"].value());
+
+  // Pushing another kind of value turns the list back into nodes.
+  json["ints"]->push(JsonNode("five"));
+  EXPECT_TRUE(json["ints"]->isType(JsonNode::List));
+  EXPECT_EQ(json["ints"][3]->toInt(), 4);
+  EXPECT_STREQ(json["ints"][4]->toString().data(), "five");
+
+  // Ints are 64-bit; values beyond that are rejected rather than wrapped.
+  Json wide(R"({"t": [1700000000000, 2], "min": -0x8000000000000000,
+                "max": 9223372036854775807})");
+  ASSERT_TRUE(wide.valid());
+  EXPECT_EQ(wide["t"]->asIntSpan()[0], int64_t(1700000000000));
+  EXPECT_EQ(wide["min"]->toInt(), INT64_MIN);
+  EXPECT_STREQ(wide.str().data(),
+               R"({"max": 9223372036854775807, "min": -9223372036854775808, "t": [1700000000000, 2]})");
+  EXPECT_FALSE(Json(R"({"t": [9223372036854775808]})").valid());
+  EXPECT_FALSE(Json(R"({"t": 0x10000000000000000})").valid());
+  EXPECT_FALSE(
+      Json(R"({"id": 1, "t": -9223372036854775809})", JsonProjection{"id"})
+          .valid());
+
+  // Ints and floats make a float list, unless other values follow.
+  Json mixed(R"({"numbers": [1, 2.5, 3], "a": [1, 2.5, "x"],
+                 "b": [0.5, 2, [3]]})");
+  EXPECT_TRUE(mixed.valid());
+  EXPECT_TRUE(mixed["numbers"]->isType(JsonNode::FloatList));
+  EXPECT_TRUE(mixed["a"][0]->isInt());
+  EXPECT_TRUE(mixed["a"][1]->isFloat());
+  EXPECT_TRUE(mixed["b"][1]->isInt());
+  EXPECT_STREQ(mixed.str().data(),
+               R"({"a": [1, 2.500000, "x"], "b": [0.500000, 2, [3]], "numbers": [1.000000, 2.500000, 3.000000]})");
+}
+
+TEST(SimpleJson, Iteration) {
+  using namespace std;
+  using namespace json;
+
+  Json json(R"({"b": {"x": 1, "y": 2}, "a": [{"v": 3}], "c": 4})");
+  EXPECT_TRUE(json.valid());
+  auto root = json.root();
+
+  vector<string> keys(root.keys().begin(), root.keys().end());
+  EXPECT_EQ(keys, vector<string>({"a", "b", "c"}));
+
+  int sum = 0;
+  size_t before_edit = root->hash();
+  for (auto& [key, value] : root["b"].items()) {
+    sum += value.toInt();
+    value = JsonNode(0);
+  }
+  EXPECT_EQ(sum, 3);
+  EXPECT_EQ(json["b"]["x"]->toInt(), 0);
+  EXPECT_NE(root->hash(), before_edit);
+
+  const JsonNode& list = *json["a"].value();
+  EXPECT_EQ(distance(list.elements().begin(), list.elements().end()), 1);
+  for (const auto& element : list.elements()) {
+    EXPECT_EQ(element.at("v")->toInt(), 3);
+  }
+  EXPECT_EQ(count_if(root["b"].keys().begin(), root["b"].keys().end(),
+                     [](const string& key) { return key == "y"; }),
+            1);
+
+  EXPECT_TRUE(json["c"]->items().empty());
+  EXPECT_TRUE(json["c"]->elements().empty());
+  EXPECT_TRUE(json["missing"].items().empty());
+  EXPECT_TRUE(json["missing"].keys().empty());
+  EXPECT_TRUE(json.root().at("missing").elements().empty());
+
+  // Packed lists are read in place by the const view.
+  Json packed(R"({"ints": [1, 2, 3], "flags": [true, false]})");
+  const JsonNode& ints = *packed["ints"].value();
+  auto span = ints.asIntSpan();
+  int64_t total = 0;
+  for (const auto& element : ints.elements()) {
+    EXPECT_TRUE(element.isInt());
+    total += element.toInt();
+  }
+  EXPECT_EQ(total, 6);
+  EXPECT_TRUE(ints.isType(JsonNode::IntList));
+  EXPECT_EQ(span.data(), ints.asIntSpan().data());
+  const JsonNode& flags = *packed["flags"].value();
+  vector<bool> bits;
+  for (const auto& element : flags.elements()) bits.push_back(element.toBool());
+  EXPECT_EQ(bits, vector<bool>({true, false}));
+  EXPECT_TRUE(flags.isType(JsonNode::BoolList));
+
+  // So is a packed list reached through a mutable reference.
+  total = 0;
+  for (const auto& element : packed["ints"].elements()) {
+    total += element.toInt();
+  }
+  EXPECT_EQ(total, 6);
+  EXPECT_TRUE(packed["ints"]->isType(JsonNode::IntList));
+}
+
+TEST(SimpleJson, HashAndDiff) {
+  using namespace std;
+  using namespace json;
+
+  string text = R"({"name": "config", "limits": {"cpu": 2, "mem": 512},
+                    "ports": [80, 443], "flags": {"debug": false}})";
+  Json before(text);
+  Json after(text);
+  EXPECT_TRUE(before.valid() && after.valid());
+
+  const JsonNode& old_root = *before.root().value();
+  const JsonNode& new_root = *after.root().value();
+  EXPECT_EQ(old_root.hash(), new_root.hash());
+  EXPECT_TRUE(old_root == new_root);
+  EXPECT_EQ(JsonPatch::Diff(old_root, new_root).str(), "[]");
+
+  // Packed and unpacked lists are equal and hash alike.
+  JsonNode packed = JsonNode::IntListType{80, 443};
+  JsonNode nodes = vector<JsonNode>{JsonNode(80), JsonNode(443)};
+  EXPECT_EQ(packed.hash(), nodes.hash());
+
+  *after["limits"]["mem"].value() = JsonNode(1024);
+  after["ports"]->push(JsonNode(8080));
+  after["flags"]->insert("trace", JsonNode(true));
+  after.root()->insert("owner", JsonNode("ops"));
+  EXPECT_NE(old_root.hash(), new_root.hash());
+  EXPECT_FALSE(old_root == new_root);
+
+  JsonNode patch = JsonPatch::Diff(old_root, new_root);
+  EXPECT_STREQ(
+      patch.str().data(),
+      R"([{"op": "add", "path": "/flags/trace", "value": true}, {"op": "replace", "path": "/limits/mem", "value": 1024}, {"op": "add", "path": "/owner", "value": "ops"}, {"op": "add", "path": "/ports/-", "value": 8080}])");
+  // Diffing reads packed lists in place.
+  EXPECT_TRUE(old_root.at("ports")->isType(JsonNode::IntList));
+  EXPECT_EQ(JsonPatch::Diff(JsonNode::IntListType{1, 2, 3},
+                            JsonNode::IntListType{1, 5})
+                .str(),
+            R"([{"op": "replace", "path": "/1", "value": 5}, {"op": "remove", "path": "/2"}])");
+
+  JsonNode patched = old_root;
+  EXPECT_TRUE(JsonPatch::Apply(&patched, move(patch)));
+  EXPECT_TRUE(patched == new_root);
+  EXPECT_EQ(patched.hash(), new_root.hash());
+
+  // Edits through saved child references reach the caches of ancestors.
+  Json left(text);
+  Json right(text);
+  JsonNode& left_root = *left.root().value();
+  const JsonNode& right_root = *right.root().value();
+  auto cpu = left["limits"]["cpu"];
+  EXPECT_EQ(left_root.hash(), right_root.hash());
+  *cpu.value() = JsonNode(4);
+  EXPECT_NE(left_root.hash(), right_root.hash());
+  EXPECT_FALSE(left_root == right_root);
+  EXPECT_STREQ(JsonPatch::Diff(right_root, left_root).str().data(),
+               R"([{"op": "replace", "path": "/limits/cpu", "value": 4}])");
+  *cpu.value() = JsonNode(2);
+  EXPECT_EQ(left_root.str(), right_root.str());
+  EXPECT_TRUE(left_root == right_root);
+  EXPECT_EQ(left_root.hash(), right_root.hash());
+
+  // Reconstruct is an edit like any other.
+  Json x_left(R"({"x": {"y": 1}})");
+  Json x_right(R"({"x": {"y": 1}})");
+  EXPECT_EQ(x_left.root()->hash(), x_right.root()->hash());
+  JsonNode::Reconstruct(x_left["x"]["y"].value(), JsonNode(2));
+  EXPECT_STREQ(
+      JsonPatch::Diff(*x_right.root().value(), *x_left.root().value())
+          .str()
+          .data(),
+      R"([{"op": "replace", "path": "/x/y", "value": 2}])");
+
+  // Nodes added by patches and push() reach their ancestors too.
+  auto parse = [](const char* text) { return *Json(text).root().value(); };
+  JsonNode doc = parse(R"({"a": {"b": [{"c": 1}]}})");
+  EXPECT_TRUE(JsonPatch::Apply(
+      &doc, parse(R"([{"op": "add", "path": "/a/b/0", "value": {"c": 0}},
+                      {"op": "add", "path": "/a/d", "value": {"e": 1}}])")));
+  EXPECT_TRUE(JsonPatch::MergeApply(&doc, parse(R"({"f": {"g": 1}})")));
+  JsonNode pushed = parse(R"({"h": 1})");
+  doc["a"]["b"]->push(move(pushed));
+  for (auto* value : {doc["a"]["b"][0]["c"].value(), doc["a"]["d"]["e"].value(),
+                      doc["f"]["g"].value(), doc["a"]["b"][2]["h"].value()}) {
+    size_t before_edit = doc.hash();
+    *value = JsonNode(7);
+    EXPECT_NE(doc.hash(), before_edit);
+  }
+  EXPECT_EQ(doc.hash(), parse(R"({"a": {"b": [{"c": 7}, {"c": 1}, {"h": 7}],
+                                       "d": {"e": 7}}, "f": {"g": 7}})")
+                            .hash());
+
+  // The caches live off the node, which only links to its parent.
+  EXPECT_LE(sizeof(JsonNode), 80);
+}
+
+TEST(SimpleJson, DepthLimit) {
+  using namespace std;
+  using namespace json;
+
+  const size_t depth = 100000;
+  string deep = string(depth, '[') + string(depth, ']');
+  EXPECT_FALSE(Json(deep).valid());
+  EXPECT_FALSE(Json(R"({"a": [[[1]]]})", 3).valid());
+  EXPECT_TRUE(Json(R"({"a": [[1]]})", 3).valid());
+
+  // Skipped members still count towards the limit.
+  EXPECT_FALSE(Json(R"({"a": [[[1]]], "b": 1})", JsonProjection{"b"}, 3)
+                   .valid());
+
+  // Deep trees can still be built, printed and destroyed when allowed.
+  Json allowed("{\"a\": " + deep + "}", depth + 1);
+  EXPECT_TRUE(allowed.valid());
+  EXPECT_EQ(allowed["a"]->str(), deep);
+  const JsonNode& deep_root = *allowed.root().value();
+  EXPECT_EQ(JsonParallelWriter(4).str(deep_root), deep_root.str());
+  Json same("{\"a\": " + deep + "}", depth + 1);
+  EXPECT_EQ(deep_root.hash(), same.root()->hash());
+  EXPECT_TRUE(deep_root == *same.root().value());
+
+  // Copies, diffs and merges of deep trees.
+  JsonNode copy = deep_root;
+  EXPECT_TRUE(copy == deep_root);
+  copy = *same.root().value();
+  EXPECT_EQ(copy.str(), deep_root.str());
+  Json changed("{\"a\": " + string(depth, '[') + "1" + string(depth, ']') + "}",
+               depth + 1);
+  ASSERT_TRUE(changed.valid());
+  JsonNode diff = JsonPatch::Diff(deep_root, *changed.root().value());
+  ASSERT_EQ(diff.toList().size(), 1);
+  EXPECT_STREQ(diff.at(size_t(0)).at("op")->toString().data(), "add");
+  JsonNode patched = deep_root;
+  EXPECT_TRUE(JsonPatch::Apply(&patched, move(diff)));
+  EXPECT_TRUE(patched == *changed.root().value());
+  string nested_objs;
+  for (size_t i = 0; i < depth; ++i) nested_objs.append("{\"a\": ");
+  nested_objs.append("1" + string(depth, '}'));
+  Json merge_patch(nested_objs, depth);
+  ASSERT_TRUE(merge_patch.valid());
+  JsonNode merged = *merge_patch.root().value();
+  EXPECT_TRUE(JsonPatch::MergeApply(&merged, merge_patch.root()->clone()));
+  EXPECT_TRUE(JsonPatch::MergeApply(&copy, merge_patch.root()->clone()));
+  EXPECT_TRUE(copy == *merge_patch.root().value());
+
+  // Shapes the pattern based parser could not read.
+  Json mixed(R"({"list": [], "obj": {}, "mixed": [1, "two", [3.5], {"f": [true]}, null],
+                 "objs": [{"a": 1}, {"a": 2}], "strs": ["x", "y\n"]})");
+  EXPECT_TRUE(mixed.valid());
+  EXPECT_STREQ(
+      mixed.str().data(),
+      R"({"list": [], "mixed": [1, "two", [3.500000], {"f": [true]}, null], "obj": {}, "objs": [{"a": 1}, {"a": 2}], "strs": ["x", "y\n"]})");
+  EXPECT_FALSE(Json(R"({"a": 1} {"b": 2})").valid());
+  EXPECT_FALSE(Json(R"({"a": [1, 2}])").valid());
+}
+
+TEST(SimpleJson, Unicode) {
+  using namespace std;
+  using namespace json;
+
+  Json json(R"({"esc": "a\u00e9\u4E2D\ud83d\ude00\/\n",
+                "raw": "café – 中文 plain ascii run that is long",
+                "keyé": ["A", "\"q\""]})");
+  EXPECT_TRUE(json.valid());
+  EXPECT_EQ(json["esc"]->toString(),
+            "a\xc3\xa9\xe4\xb8\xad\xf0\x9f\x98\x80/\n");
+  EXPECT_EQ(json["raw"]->toString(),
+            "caf\xc3\xa9 \xe2\x80\x93 \xe4\xb8\xad\xe6\x96\x87 plain ascii "
+            "run that is long");
+  EXPECT_EQ(json["key\xc3\xa9"][0]->toString(), "A");
+  EXPECT_EQ(json["key\xc3\xa9"][1]->toString(), "\"q\"");
+
+  vector<string> invalid_list = {
+      "{\"a\": \"\xc3\"}",              // truncated sequence
+      "{\"a\": \"\xc0\xaf\"}",          // overlong
+      "{\"a\": \"\xed\xa0\x80\"}",      // encoded surrogate
+      "{\"a\": \"\xf4\x90\x80\x80\"}",  // beyond U+10FFFF
+      "{\"a\": \"0123456789abcdef\xff\"}",
+      R"({"a": "\ud83d"})",  // lone high surrogate
+      R"({"a": "\ude00"})",  // lone low surrogate
+      R"({"a": "\u12"})",
+      R"({"a": "\q"})",
+  };
+  // Validate agrees with the parser on every one of them.
+  for (const auto& invalid : invalid_list) {
+    EXPECT_FALSE(Json(invalid).valid()) << invalid;
+    EXPECT_FALSE(Validate(invalid)) << invalid;
+  }
+  EXPECT_TRUE(Validate(R"(["\ud83d\ude00 \u00e9\/"])"));
+  // Control characters must be escaped.
+  for (const char* raw_control : {"{\"a\": \"x\ny\"}",
+                                  "{\"a\": \"0123456789abcdef\t\"}",
+                                  "{\"a\tb\": 1}"}) {
+    EXPECT_FALSE(Json(raw_control).valid()) << raw_control;
+    EXPECT_FALSE(Validate(raw_control)) << raw_control;
+  }
+  EXPECT_FALSE(Validate("[\"0123456789abcdef\xc3\x28\"]"));
+  EXPECT_TRUE(Validate("[\"0123456789abcdef\xc3\xa9\xe4\xb8\xad\"]"));
+}
+
+TEST(SimpleJson, Columns) {
+  using namespace std;
+  using namespace json;
+
+  JsonShredder text_shredder;
+  EXPECT_EQ(text_shredder.appendLines(
+                R"({"id": 1, "name": "a", "tags": ["x", "y"], "geo": {"lat": 1}})"
+                "\n\n"
+                R"({"id": 2, "tags": [], "geo": {"lat": 2.5}, "ok": true})"
+                "\n"
+                R"({"id": 3, "name": "c", "broken": [})"
+                "\n"
+                R"({"id": null, "name": "dé", "tags": [["z"]]})"
+                "\n"),
+            1);
+  EXPECT_EQ(text_shredder.rows(), 3);
+  EXPECT_EQ(text_shredder.column("broken[]", JsonColumn::Int), nullptr);
+
+  JsonShredder node_shredder;
+  for (const char* record :
+       {R"({"id": 1, "name": "a", "tags": ["x", "y"], "geo": {"lat": 1}})",
+        R"({"id": 2, "tags": [], "geo": {"lat": 2.5}, "ok": true})",
+        R"({"name": "dé", "tags": [["z"]]})"}) {
+    Json json{string(record)};
+    ASSERT_TRUE(json.valid()) << record;
+    node_shredder.append(*json.root().value());
+  }
+
+  for (const JsonShredder* shredder : {&text_shredder, &node_shredder}) {
+    vector<string> paths;
+    for (const auto& [path, column] : shredder->columns()) {
+      paths.push_back(path);
+    }
+    EXPECT_EQ(paths, (vector<string>{"geo.lat", "id", "name", "ok", "tags[]",
+                                     "tags[][]"}));
+
+    const JsonColumn* id = shredder->column("id", JsonColumn::Float);
+    ASSERT_NE(id, nullptr);
+    EXPECT_EQ(id->type, JsonColumn::Int);
+    EXPECT_EQ(id->ints, (vector<int64_t>{1, 2, 0}));
+    EXPECT_EQ(id->valid, (vector<bool>{true, true, false}));
+
+    const JsonColumn* lat = shredder->column("geo.lat", JsonColumn::Int);
+    ASSERT_NE(lat, nullptr);
+    EXPECT_EQ(lat->type, JsonColumn::Float);
+    EXPECT_EQ(lat->floats, (vector<double>{1, 2.5, 0}));
+
+    const JsonColumn* name = shredder->column("name", JsonColumn::String);
+    ASSERT_NE(name, nullptr);
+    EXPECT_EQ(name->valid, (vector<bool>{true, false, true}));
+    EXPECT_EQ(name->stringAt(0), "a");
+    EXPECT_EQ(name->stringAt(2), "d\xc3\xa9");
+
+    const JsonColumn* ok = shredder->column("ok", JsonColumn::Bool);
+    ASSERT_NE(ok, nullptr);
+    EXPECT_EQ(ok->valid, (vector<bool>{false, true, false}));
+
+    const JsonColumn* tags = shredder->column("tags[]", JsonColumn::String);
+    ASSERT_NE(tags, nullptr);
+    EXPECT_TRUE(tags->repeated);
+    EXPECT_EQ(tags->row_offsets, (vector<uint64_t>{0, 2, 2, 2}));
+    EXPECT_EQ(tags->stringAt(1), "y");
+    const JsonColumn* nested = shredder->column("tags[][]", JsonColumn::String);
+    ASSERT_NE(nested, nullptr);
+    EXPECT_EQ(nested->row_offsets, (vector<uint64_t>{0, 0, 0, 1}));
+  }
+
+  JsonShredder packed;
+  Json scores(R"({"scores": [1, 2, 3], "flags": [true, false]})");
+  packed.append(*scores.root().value());
+  packed.append(*scores.root().value());
+  const JsonColumn* column = packed.column("scores[]", JsonColumn::Int);
+  ASSERT_NE(column, nullptr);
+  EXPECT_EQ(column->ints, (vector<int64_t>{1, 2, 3, 1, 2, 3}));
+  EXPECT_EQ(column->row_offsets, (vector<uint64_t>{0, 3, 6}));
+  EXPECT_EQ(packed.column("flags[]", JsonColumn::Bool)->size(), 4);
+
+  // Null list elements keep their place in the columns of their path.
+  JsonShredder text_nulls;
+  JsonShredder node_nulls;
+  for (const char* record : {R"({"tags": ["a", null]})",
+                             R"({"tags": [null, 1, "b", null]})",
+                             R"({"tags": [null]})"}) {
+    EXPECT_TRUE(text_nulls.append(string_view(record)));
+    Json json{string(record)};
+    node_nulls.append(*json.root().value());
+  }
+  for (const JsonShredder* shredder : {&text_nulls, &node_nulls}) {
+    const JsonColumn* strings = shredder->column("tags[]", JsonColumn::String);
+    ASSERT_NE(strings, nullptr);
+    EXPECT_EQ(strings->row_offsets, (vector<uint64_t>{0, 2, 5, 5}));
+    EXPECT_EQ(strings->valid,
+              (vector<bool>{true, false, false, true, false}));
+    EXPECT_EQ(strings->stringAt(3), "b");
+    const JsonColumn* ints = shredder->column("tags[]", JsonColumn::Int);
+    ASSERT_NE(ints, nullptr);
+    EXPECT_EQ(ints->ints, (vector<int64_t>{0, 1, 0}));
+    EXPECT_EQ(ints->valid, (vector<bool>{false, true, false}));
+    EXPECT_EQ(ints->row_offsets, (vector<uint64_t>{0, 0, 3, 3}));
+  }
+
+  // A dropped record takes back its promotion of an int column to floats.
+  JsonShredder promoted;
+  EXPECT_EQ(promoted.appendLines("{\"n\": 9007199254740993, \"l\": [1]}\n"
+                                 "{\"n\": 1.5, \"l\": [2, 2.5], \"x\": [}\n"
+                                 "{\"n\": 2, \"l\": [3]}\n"),
+            1);
+  for (const char* path : {"n", "l[]"}) {
+    const JsonColumn* restored = promoted.column(path, JsonColumn::Int);
+    ASSERT_NE(restored, nullptr);
+    EXPECT_EQ(restored->type, JsonColumn::Int) << path;
+    EXPECT_TRUE(restored->floats.empty()) << path;
+  }
+  EXPECT_EQ(promoted.column("n", JsonColumn::Int)->ints,
+            (vector<int64_t>{9007199254740993, 2}));
+  EXPECT_EQ(promoted.column("l[]", JsonColumn::Int)->ints,
+            (vector<int64_t>{1, 3}));
+}
+
+TEST(SimpleJson, Writer) {
+  using namespace std;
+  using namespace json;
+
+  string out;
+  JsonWriter<string> writer(&out);
+  writer.beginObject();
+  writer.key("id");
+  writer.value(42);
+  writer.key("ratio");
+  writer.value(0.25);
+  writer.key("tags");
+  writer.beginList();
+  writer.value("a\"b");
+  writer.value(string("line\n\x01"));
+  writer.beginObject();
+  writer.endObject();
+  writer.value(nullptr);
+  writer.endList();
+  writer.key("ok");
+  writer.value(true);
+  writer.key("big");
+  writer.value(int64_t(1) << 40);
+  writer.endObject();
+  EXPECT_TRUE(writer.done());
+  EXPECT_EQ(out,
+            R"({"id":42,"ratio":0.25,"tags":["a\"b","line\n\u0001",{},null],)"
+            R"("ok":true,"big":1099511627776})");
+  EXPECT_TRUE(Validate(out));
+
+  string second;
+  writer.reset(&second);
+  writer.beginList();
+  EXPECT_FALSE(writer.done());
+  writer.endList();
+  EXPECT_EQ(second, "[]");
+
+  string long_text(100, 'x');
+  long_text[70] = '\t';
+  EXPECT_EQ(EscapeJson(long_text),
+            string(70, 'x') + "\\t" + string(29, 'x'));
+  EXPECT_EQ(EscapeJson("caf\xc3\xa9\x1f"), "caf\xc3\xa9\\u001f");
+
+  string bad;
+  JsonWriter<string> misuse(&bad);
+  misuse.beginList();
+  EXPECT_DEBUG_DEATH(misuse.key("nope"), "");
+}
+
+TEST(SimpleJson, RecordStream) {
+  using namespace std;
+  using namespace json;
+
+  string text;
+  vector<string> expected;
+  for (int i = 0; i < 500; ++i) {
+    expected.push_back(R"({"id": )" + to_string(i) +
+                       R"(, "note": "a \"}\" and \\ ]", "list": [[1], {}]})");
+    text += expected.back() + "\n";
+  }
+  expected.push_back(R"("tail }")");
+  expected.push_back("-1.5e3");
+  text += expected[500] + " " + expected[501];
+
+  z_stream stream{};
+  ASSERT_EQ(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                         8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  string gzip(deflateBound(&stream, text.size()), '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(&text[0]);
+  stream.avail_in = text.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&gzip[0]);
+  stream.avail_out = gzip.size();
+  ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  gzip.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  JsonRecordReader::Options options;
+  options.chunk_size = 61;
+  options.queue_chunks = 2;
+  JsonRecordReader reader(options);
+  for (const string* input : {&text, &gzip}) {
+    vector<string> records;
+    istringstream in(*input);
+    EXPECT_TRUE(reader.read(&in, [&](string_view record) {
+      records.emplace_back(record);
+      return Validate(record).valid;
+    }));
+    EXPECT_EQ(records, expected);
+  }
+
+  // Truncated input, and a callback that stops early.
+  istringstream truncated(gzip.substr(0, gzip.size() / 2));
+  size_t seen = 0;
+  EXPECT_FALSE(reader.read(&truncated, [&](string_view) { return ++seen, true; }));
+  EXPECT_GT(seen, 0);
+  istringstream again(gzip);
+  seen = 0;
+  EXPECT_FALSE(reader.read(&again, [&](string_view) { return ++seen < 3; }));
+  EXPECT_EQ(seen, 3);
+  // A throwing callback leaves through the exception, with the reading
+  // thread stopped even if it is blocked on a full queue.
+  istringstream thrown(gzip);
+  EXPECT_THROW(reader.read(&thrown,
+                           [](string_view) -> bool {
+                             throw runtime_error("stop");
+                           }),
+               runtime_error);
+
+  options.unwrap_list = true;
+  JsonRecordReader unwrapping(options);
+  vector<string> elements;
+  istringstream list(R"( [ {"a": [1, 2]}, 3, "x,]" , [] ] )");
+  EXPECT_TRUE(unwrapping.read(&list, [&](string_view record) {
+    elements.emplace_back(record);
+    return true;
+  }));
+  EXPECT_EQ(elements, (vector<string>{R"({"a": [1, 2]})", "3", R"("x,]")", "[]"}));
+  istringstream open_list("[1, 2");
+  EXPECT_FALSE(unwrapping.read(&open_list, [](string_view) { return true; }));
+}
+
+TEST(SimpleJson, ListIndex) {
+  using namespace std;
+  using namespace json;
+
+  string text = "[";
+  for (int i = 0; i < 1000; ++i) {
+    if (i > 0) text += ", ";
+    text += R"({"id": )" + to_string(i) + R"(, "user": {"name": "u)" +
+            to_string(i % 10) + R"("}})";
+  }
+  text += R"(, {"name": "no id"}, 7])";
+  Json json(text);
+  ASSERT_TRUE(json.valid());
+  JsonNode& list = *json.root().value();
+
+  const ListIndex& by_id = list.indexBy("id");
+  EXPECT_EQ(by_id.size(), 1000);
+  EXPECT_EQ(by_id.position(JsonNode(500)), 500);
+  EXPECT_EQ(by_id.find(999)->at("user").at("name")->toString(), "u9");
+  EXPECT_FALSE(by_id.find(1000));
+  EXPECT_FALSE(by_id.find(500.0));
+  EXPECT_EQ(&list.indexBy("id"), &by_id);
+
+  // Duplicate values keep the first element.
+  const ListIndex& by_name = list.indexBy("user.name");
+  EXPECT_EQ(by_name.size(), 10);
+  EXPECT_EQ(by_name.position("u3"), 3);
+
+  JsonNode added;
+  added.insert("id", JsonNode(1000));
+  list.push(move(added));
+  EXPECT_EQ(by_id.position(JsonNode(1000)), 1002);
+  EXPECT_EQ(by_name.size(), 10);
+
+  // Other edits rebuild the index on its next lookup.
+  *list[0]["id"].value() = JsonNode(-1);
+  EXPECT_FALSE(by_id.find(0));
+  EXPECT_EQ(by_id.position(JsonNode(-1)), 0);
+
+  // So do edits through saved references.
+  auto first = list[0];
+  EXPECT_EQ(list.indexBy("id").position(JsonNode(-1)), 0);
+  *first["id"].value() = JsonNode(77);
+  EXPECT_EQ(by_id.position(JsonNode(77)), 0);
+  EXPECT_EQ(by_id.position(JsonNode(1)), 1);
+  EXPECT_EQ(by_id.position(JsonNode(-1)), ListIndex::npos);
+  *first.value() = JsonNode(5);
+  EXPECT_EQ(by_id.position(JsonNode(77)), 77);
+  EXPECT_FALSE(list.indexBy("id").find(JsonNode(-1)));
+  EXPECT_EQ(list[2]["id"]->toInt(), 2);
+  EXPECT_EQ(by_name.position("u3"), 3);
+
+  // Lookups may run concurrently.
+  vector<thread> readers;
+  vector<size_t> found(4);
+  for (size_t i = 0; i < found.size(); ++i) {
+    readers.emplace_back([&, i] {
+      found[i] = list.indexBy("user.name").position(JsonNode("u9")) +
+                 by_id.position(JsonNode(int(100 + i)));
+    });
+  }
+  for (auto& reader : readers) reader.join();
+  EXPECT_EQ(found, vector<size_t>({109, 110, 111, 112}));
+
+  JsonNode copy = list;
+  EXPECT_EQ(copy.indexBy("id").position(JsonNode(1)), 1);
+  EXPECT_EQ(JsonNode("scalar").indexBy("id").size(), 0);
+}